@@ -0,0 +1,300 @@
+/*
+ * Concurrent allocation stress test for ouiche_fs.
+ *
+ * Each thread creates its own directory below the target directory and fills
+ * files in it, writing one block to each file in turn so that the block
+ * allocations of all threads interleave. Once all threads are done, the
+ * physical extents of every file are collected with FIEMAP and checked: no
+ * block and no inode may be used twice.
+ *
+ * Usage: alloc-stress [-t threads] [-f files] [-b blocks] dir
+ *   -t  number of threads (default: number of online CPUs)
+ *   -f  files per thread (default: 32, directories are limited to 128 files)
+ *   -b  blocks per file (default: 64)
+ *
+ * The partition must be large enough to hold everything without evicting
+ * files, else the check is incomplete (evicted files are reported).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#define OUICHEFS_BLOCK_SIZE 4096
+#define FIEMAP_BATCH 64
+
+struct extent {
+	uint64_t start; /* First physical byte */
+	uint64_t len;
+	ino_t ino;
+};
+
+static const char *root;
+static int nr_threads, nr_files = 32, nr_blocks = 64;
+
+static struct extent *extents;
+static size_t nr_extents, max_extents;
+
+static void *writer(void *arg)
+{
+	long id = (long)arg;
+	char path[4096], buf[OUICHEFS_BLOCK_SIZE];
+	int *fds, f, b;
+
+	fds = calloc(nr_files, sizeof(*fds));
+	if (!fds)
+		return (void *)-1L;
+	memset(buf, 'a' + id % 26, sizeof(buf));
+
+	snprintf(path, sizeof(path), "%s/t%ld", root, id);
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		perror(path);
+		return (void *)-1L;
+	}
+	for (f = 0; f < nr_files; f++) {
+		snprintf(path, sizeof(path), "%s/t%ld/f%d", root, id, f);
+		fds[f] = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+		if (fds[f] < 0) {
+			perror(path);
+			return (void *)-1L;
+		}
+	}
+
+	for (b = 0; b < nr_blocks; b++) {
+		for (f = 0; f < nr_files; f++) {
+			if (write(fds[f], buf, sizeof(buf)) != sizeof(buf)) {
+				perror("write");
+				return (void *)-1L;
+			}
+		}
+	}
+
+	for (f = 0; f < nr_files; f++) {
+		fsync(fds[f]);
+		close(fds[f]);
+	}
+	free(fds);
+
+	return NULL;
+}
+
+static int add_extent(uint64_t start, uint64_t len, ino_t ino)
+{
+	if (nr_extents == max_extents) {
+		max_extents = max_extents ? max_extents * 2 : 1024;
+		extents = realloc(extents, max_extents * sizeof(*extents));
+		if (!extents)
+			return -1;
+	}
+	extents[nr_extents].start = start;
+	extents[nr_extents].len = len;
+	extents[nr_extents].ino = ino;
+	nr_extents++;
+
+	return 0;
+}
+
+/* Add the physical extents of path to the extents array */
+static int collect(const char *path, ino_t *ino)
+{
+	struct fiemap *fm;
+	struct stat st;
+	uint64_t start = 0;
+	unsigned int i;
+	int fd, last = 0, ret = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st))
+		goto close;
+	*ino = st.st_ino;
+
+	fm = calloc(1, sizeof(*fm) +
+			       FIEMAP_BATCH * sizeof(struct fiemap_extent));
+	if (!fm)
+		goto close;
+
+	while (!last) {
+		fm->fm_start = start;
+		fm->fm_length = FIEMAP_MAX_OFFSET - start;
+		fm->fm_flags = FIEMAP_FLAG_SYNC;
+		fm->fm_extent_count = FIEMAP_BATCH;
+		if (ioctl(fd, FS_IOC_FIEMAP, fm)) {
+			perror("FS_IOC_FIEMAP");
+			goto free;
+		}
+		if (!fm->fm_mapped_extents)
+			break;
+		for (i = 0; i < fm->fm_mapped_extents; i++) {
+			struct fiemap_extent *fe = &fm->fm_extents[i];
+
+			if (add_extent(fe->fe_physical, fe->fe_length,
+				       st.st_ino))
+				goto free;
+			start = fe->fe_logical + fe->fe_length;
+			if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+				last = 1;
+		}
+	}
+	ret = 0;
+
+free:
+	free(fm);
+close:
+	close(fd);
+	return ret;
+}
+
+static int cmp_extent(const void *a, const void *b)
+{
+	const struct extent *ea = a, *eb = b;
+
+	return ea->start < eb->start ? -1 : ea->start > eb->start;
+}
+
+static int cmp_ino(const void *a, const void *b)
+{
+	const ino_t *ia = a, *ib = b;
+
+	return *ia < *ib ? -1 : *ia > *ib;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *threads;
+	ino_t *inos;
+	char path[4096];
+	size_t nr_inos = 0, i, errors = 0, missing = 0;
+	double start, elapsed;
+	long t;
+	int opt, f;
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "t:f:b:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'f':
+			nr_files = atoi(optarg);
+			break;
+		case 'b':
+			nr_blocks = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || nr_threads <= 0 || nr_files <= 0 ||
+	    nr_blocks <= 0)
+		goto usage;
+	root = argv[optind];
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	inos = calloc((size_t)nr_threads * (nr_files + 1), sizeof(*inos));
+	if (!threads || !inos) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	start = now();
+	for (t = 0; t < nr_threads; t++) {
+		if (pthread_create(&threads[t], NULL, writer, (void *)t)) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+	for (t = 0; t < nr_threads; t++) {
+		void *ret;
+
+		pthread_join(threads[t], &ret);
+		if (ret)
+			errors++;
+	}
+	elapsed = now() - start;
+	printf("%d threads wrote %d files of %d blocks each in %.3f s (%.1f MiB/s)\n",
+	       nr_threads, nr_files, nr_blocks, elapsed,
+	       (double)nr_threads * nr_files * nr_blocks * OUICHEFS_BLOCK_SIZE /
+		       (1 << 20) / elapsed);
+	if (errors) {
+		fprintf(stderr, "%zu writers failed\n", errors);
+		return EXIT_FAILURE;
+	}
+
+	/* Collect the inodes and extents of all files */
+	for (t = 0; t < nr_threads; t++) {
+		struct stat st;
+
+		snprintf(path, sizeof(path), "%s/t%ld", root, t);
+		if (stat(path, &st))
+			missing++;
+		else
+			inos[nr_inos++] = st.st_ino;
+		for (f = 0; f < nr_files; f++) {
+			snprintf(path, sizeof(path), "%s/t%ld/f%d", root, t, f);
+			if (collect(path, &inos[nr_inos])) {
+				if (errno != ENOENT) {
+					perror(path);
+					return EXIT_FAILURE;
+				}
+				missing++;
+				continue;
+			}
+			nr_inos++;
+		}
+	}
+	if (missing)
+		printf("%zu files were evicted, they are not checked\n",
+		       missing);
+
+	qsort(inos, nr_inos, sizeof(*inos), cmp_ino);
+	for (i = 1; i < nr_inos; i++) {
+		if (inos[i] == inos[i - 1]) {
+			printf("inode %lu allocated twice\n",
+			       (unsigned long)inos[i]);
+			errors++;
+		}
+	}
+
+	qsort(extents, nr_extents, sizeof(*extents), cmp_extent);
+	for (i = 1; i < nr_extents; i++) {
+		struct extent *prev = &extents[i - 1], *cur = &extents[i];
+
+		if (prev->start + prev->len > cur->start) {
+			printf("block %llu used by inodes %lu and %lu\n",
+			       (unsigned long long)cur->start / OUICHEFS_BLOCK_SIZE,
+			       (unsigned long)prev->ino,
+			       (unsigned long)cur->ino);
+			errors++;
+		}
+	}
+
+	printf("checked %zu inodes and %zu extents: %zu errors\n", nr_inos,
+	       nr_extents, errors);
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-t threads] [-f files] [-b blocks] dir\n",
+		argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# Sustained append benchmark: mounts a fresh ouichefs image on a loop device
+# and appends to a few files, reporting the writeback throughput of each pass.
+# Must be run as root from the repository root after building the module and
+# mkfs (make && make -C mkfs).
+#
+# Usage: bench/append.sh [-e] [-s image_size_MiB] [-f file_size_MiB] [-b bs_KiB]
+#   -e  format the image with extent trees (mkfs -e)
+
+set -e
+
+MKFS_OPTS=""
+IMG_SIZE=512
+FILE_SIZE=64
+BS=64
+NR_FILES=4
+IMG=$(mktemp --suffix=.img /tmp/ouichefs-bench.XXXXXX)
+MNT=$(mktemp -d /tmp/ouichefs-bench.XXXXXX)
+LOOP=""
+
+while getopts "es:f:b:" opt; do
+	case $opt in
+	e) MKFS_OPTS="-e" ;;
+	s) IMG_SIZE=$OPTARG ;;
+	f) FILE_SIZE=$OPTARG ;;
+	b) BS=$OPTARG ;;
+	*) exit 1 ;;
+	esac
+done
+
+cleanup() {
+	mountpoint -q "$MNT" && umount "$MNT"
+	[ -n "$LOOP" ] && losetup -d "$LOOP"
+	rm -rf "$IMG" "$MNT"
+}
+trap cleanup EXIT
+
+grep -q '^ouichefs ' /proc/modules || insmod ouichefs.ko
+
+dd if=/dev/zero of="$IMG" bs=1M count="$IMG_SIZE" status=none
+mkfs/mkfs.ouichefs $MKFS_OPTS "$IMG" > /dev/null
+LOOP=$(losetup -f --show "$IMG")
+mount -t ouichefs "$LOOP" "$MNT"
+
+# Append in bs sized writes, then syncfs the partition so that writeback is
+# included in the throughput (this doesn't need ->fsync)
+count=$((FILE_SIZE * 1024 / BS))
+for i in $(seq 1 "$NR_FILES"); do
+	start=$(date +%s.%N)
+	dd if=/dev/zero of="$MNT/f$i" bs="${BS}K" count="$count" \
+		oflag=append conv=notrunc status=none
+	sync -f "$MNT"
+	end=$(date +%s.%N)
+	awk -v i="$i" -v mib="$FILE_SIZE" -v bs="$BS" -v s="$start" -v e="$end" \
+		'BEGIN { printf "file %d (%d MiB, %d KiB writes): %.3f s, %.1f MiB/s\n",
+			 i, mib, bs, e - s, mib / (e - s) }'
+done
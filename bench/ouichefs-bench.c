@@ -0,0 +1,459 @@
+/*
+ * Workload driver for the ouiche_fs benchmarks (see bench/run.sh).
+ *
+ * Runs one workload in a directory of a mounted partition and prints one JSON
+ * object per measured operation type on stdout:
+ *   {"workload": ..., "ops": ..., "bytes": ..., "seconds": ..., "ops_per_s": ...,
+ *    "mb_per_s": ..., "p50_us": ..., "p99_us": ..., "errors": ...}
+ *
+ * Workloads:
+ *   append    appends bs sized writes to files in turn, up to size MiB in
+ *             total, and fsyncs them (one op per write)
+ *   churn     fills a directory with files, then replaces a random file
+ *             (unlink + create) ops times ("churn"), then creates ops more
+ *             files in the full directory, each evicting one ("churn-evict")
+ *   evict     writes files of file_size KiB round robin in dirs directories
+ *             until size MiB were written (by default twice the partition
+ *             size), so that files are evicted to make room (one op per file)
+ *   populate  creates dirs directories of files files (one block each)
+ *   readdir   lists the directories created by populate ("readdir", one op
+ *             per directory) and stats each file ("lookup", one op per file);
+ *             run it on a freshly mounted partition for cold caches
+ *
+ * Usage: ouichefs-bench [-f files] [-d dirs] [-n ops] [-b bs_KiB]
+ *                       [-F file_size_KiB] [-s size_MiB] workload dir
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+#define OUICHEFS_BLOCK_SIZE 4096
+
+static int nr_files = -1, nr_dirs = -1, nr_ops = 10000;
+static size_t bs = OUICHEFS_BLOCK_SIZE, file_size = 256 << 10, size;
+static char *buf;
+
+/* Latencies of one type of operation, in ns */
+struct lat {
+	uint64_t *v;
+	size_t n, max;
+	uint64_t bytes, errors;
+	double start;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void lat_start(struct lat *l)
+{
+	memset(l, 0, sizeof(*l));
+	l->start = now_ns();
+}
+
+static void lat_add(struct lat *l, uint64_t start)
+{
+	uint64_t t = now_ns() - start;
+
+	if (l->n == l->max) {
+		l->max = l->max ? l->max * 2 : 4096;
+		l->v = realloc(l->v, l->max * sizeof(*l->v));
+		if (!l->v) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	l->v[l->n++] = t;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t *ua = a, *ub = b;
+
+	return *ua < *ub ? -1 : *ua > *ub;
+}
+
+/* Print the results of l as a JSON object, the time is measured up to now */
+static void lat_report(struct lat *l, const char *workload)
+{
+	double seconds = (now_ns() - l->start) / 1e9;
+	double p50 = 0, p99 = 0;
+
+	if (l->n) {
+		qsort(l->v, l->n, sizeof(*l->v), cmp_u64);
+		p50 = l->v[(l->n - 1) * 50 / 100] / 1e3;
+		p99 = l->v[(l->n - 1) * 99 / 100] / 1e3;
+	}
+	printf("{\"workload\": \"%s\", \"ops\": %zu, \"bytes\": %llu, "
+	       "\"seconds\": %.6f, \"ops_per_s\": %.1f, \"mb_per_s\": %.2f, "
+	       "\"p50_us\": %.1f, \"p99_us\": %.1f, \"errors\": %llu}\n",
+	       workload, l->n, (unsigned long long)l->bytes, seconds,
+	       l->n / seconds, l->bytes / seconds / (1 << 20), p50, p99,
+	       (unsigned long long)l->errors);
+	fflush(stdout);
+	free(l->v);
+}
+
+static int mkdir_p(const char *path)
+{
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Create path with len bytes, return 0 or the errno of the failed call */
+static int write_file(const char *path, size_t len)
+{
+	size_t done, n;
+	int fd, err = 0;
+
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0)
+		return errno;
+	for (done = 0; done < len; done += n) {
+		n = len - done < bs ? len - done : bs;
+		if (write(fd, buf, n) != (ssize_t)n) {
+			err = errno ? errno : EIO;
+			break;
+		}
+	}
+	close(fd);
+	return err;
+}
+
+static int run_append(const char *root)
+{
+	char path[4096];
+	struct lat l;
+	uint64_t i, nr_writes;
+	uint64_t t;
+	int *fds, f;
+
+	if (nr_files < 0)
+		nr_files = 16;
+	if (!size)
+		size = 64 << 20;
+	nr_writes = size / bs;
+
+	snprintf(path, sizeof(path), "%s/append", root);
+	if (mkdir_p(path))
+		return -1;
+	fds = calloc(nr_files, sizeof(*fds));
+	if (!fds)
+		return -1;
+	for (f = 0; f < nr_files; f++) {
+		snprintf(path, sizeof(path), "%s/append/log%d", root, f);
+		fds[f] = open(path, O_CREAT | O_WRONLY | O_APPEND, 0644);
+		if (fds[f] < 0) {
+			perror(path);
+			return -1;
+		}
+	}
+
+	lat_start(&l);
+	for (i = 0; i < nr_writes; i++) {
+		t = now_ns();
+		if (write(fds[i % nr_files], buf, bs) != (ssize_t)bs) {
+			l.errors++;
+			continue;
+		}
+		lat_add(&l, t);
+		l.bytes += bs;
+	}
+	for (f = 0; f < nr_files; f++) {
+		fsync(fds[f]);
+		close(fds[f]);
+	}
+	lat_report(&l, "append");
+	free(fds);
+
+	return 0;
+}
+
+static int run_churn(const char *root)
+{
+	char path[4096];
+	unsigned int *gen;
+	struct lat l;
+	uint64_t t;
+	int i, op;
+
+	if (nr_files < 0)
+		nr_files = 128;
+
+	snprintf(path, sizeof(path), "%s/churn", root);
+	if (mkdir_p(path))
+		return -1;
+	gen = calloc(nr_files, sizeof(*gen));
+	if (!gen)
+		return -1;
+	for (i = 0; i < nr_files; i++) {
+		snprintf(path, sizeof(path), "%s/churn/f%d.0", root, i);
+		if (write_file(path, bs)) {
+			perror(path);
+			return -1;
+		}
+	}
+
+	/* Replace files, the directory stays (almost) full */
+	srand(1);
+	lat_start(&l);
+	for (op = 0; op < nr_ops; op++) {
+		i = rand() % nr_files;
+		t = now_ns();
+		snprintf(path, sizeof(path), "%s/churn/f%d.%u", root, i,
+			 gen[i]++);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/churn/f%d.%u", root, i,
+			 gen[i]);
+		if (write_file(path, bs)) {
+			l.errors++;
+			continue;
+		}
+		lat_add(&l, t);
+		l.bytes += bs;
+	}
+	lat_report(&l, "churn");
+
+	/* Create in the full directory, each create evicts a file */
+	lat_start(&l);
+	for (op = 0; op < nr_ops; op++) {
+		snprintf(path, sizeof(path), "%s/churn/e%d", root, op);
+		t = now_ns();
+		if (write_file(path, bs)) {
+			l.errors++;
+			continue;
+		}
+		lat_add(&l, t);
+		l.bytes += bs;
+	}
+	lat_report(&l, "churn-evict");
+	free(gen);
+
+	return 0;
+}
+
+static int run_evict(const char *root)
+{
+	char path[4096];
+	struct statvfs st;
+	struct lat l;
+	uint64_t nr, i, t;
+	int d, err;
+
+	if (nr_dirs < 0)
+		nr_dirs = 64;
+	if (!size) {
+		if (statvfs(root, &st)) {
+			perror(root);
+			return -1;
+		}
+		size = 2 * (size_t)st.f_blocks * st.f_frsize;
+	}
+	nr = size / file_size;
+
+	for (d = 0; d < nr_dirs; d++) {
+		snprintf(path, sizeof(path), "%s/evict%d", root, d);
+		if (mkdir_p(path))
+			return -1;
+	}
+
+	lat_start(&l);
+	for (i = 0; i < nr; i++) {
+		snprintf(path, sizeof(path), "%s/evict%d/f%llu", root,
+			 (int)(i % nr_dirs), (unsigned long long)i);
+		t = now_ns();
+		err = write_file(path, file_size);
+		if (err) {
+			l.errors++;
+			if (err != ENOSPC && err != EMLINK) {
+				errno = err;
+				perror(path);
+				return -1;
+			}
+			continue;
+		}
+		lat_add(&l, t);
+		l.bytes += file_size;
+	}
+	sync();
+	lat_report(&l, "evict");
+
+	return 0;
+}
+
+static int run_populate(const char *root)
+{
+	char path[4096];
+	struct lat l;
+	uint64_t t;
+	int d, f;
+
+	if (nr_dirs < 0)
+		nr_dirs = 64;
+	if (nr_files < 0)
+		nr_files = 100;
+
+	lat_start(&l);
+	for (d = 0; d < nr_dirs; d++) {
+		snprintf(path, sizeof(path), "%s/tree%d", root, d);
+		if (mkdir_p(path))
+			return -1;
+		for (f = 0; f < nr_files; f++) {
+			snprintf(path, sizeof(path), "%s/tree%d/f%d", root, d,
+				 f);
+			t = now_ns();
+			if (write_file(path, bs)) {
+				l.errors++;
+				continue;
+			}
+			lat_add(&l, t);
+			l.bytes += bs;
+		}
+	}
+	sync();
+	lat_report(&l, "populate");
+
+	return 0;
+}
+
+static int run_readdir(const char *root)
+{
+	char path[4096];
+	struct lat dirs, lookups;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	char **names = NULL;
+	size_t nr, max = 0, i;
+	uint64_t t;
+	int d;
+
+	if (nr_dirs < 0)
+		nr_dirs = 64;
+
+	lat_start(&dirs);
+	lat_start(&lookups);
+	for (d = 0; d < nr_dirs; d++) {
+		snprintf(path, sizeof(path), "%s/tree%d", root, d);
+
+		/* List the directory, then look every file up */
+		t = now_ns();
+		dir = opendir(path);
+		if (!dir) {
+			dirs.errors++;
+			continue;
+		}
+		nr = 0;
+		while ((de = readdir(dir))) {
+			if (de->d_name[0] == '.')
+				continue;
+			if (nr == max) {
+				max = max ? max * 2 : 256;
+				names = realloc(names, max * sizeof(*names));
+				if (!names)
+					return -1;
+			}
+			names[nr++] = strdup(de->d_name);
+		}
+		closedir(dir);
+		lat_add(&dirs, t);
+
+		for (i = 0; i < nr; i++) {
+			snprintf(path, sizeof(path), "%s/tree%d/%s", root, d,
+				 names[i]);
+			t = now_ns();
+			if (stat(path, &st))
+				lookups.errors++;
+			else
+				lat_add(&lookups, t);
+			free(names[i]);
+		}
+	}
+	/* The rates of both are computed over the whole run */
+	lat_report(&dirs, "readdir");
+	lat_report(&lookups, "lookup");
+	free(names);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *workload, *root;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "f:d:n:b:F:s:")) != -1) {
+		switch (opt) {
+		case 'f':
+			nr_files = atoi(optarg);
+			break;
+		case 'd':
+			nr_dirs = atoi(optarg);
+			break;
+		case 'n':
+			nr_ops = atoi(optarg);
+			break;
+		case 'b':
+			bs = (size_t)atoi(optarg) << 10;
+			break;
+		case 'F':
+			file_size = (size_t)atoi(optarg) << 10;
+			break;
+		case 's':
+			size = (size_t)atoi(optarg) << 20;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 2 || !nr_files || !nr_dirs || nr_ops <= 0 ||
+	    !bs || !file_size)
+		goto usage;
+	workload = argv[optind];
+	root = argv[optind + 1];
+
+	buf = malloc(bs);
+	if (!buf) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	memset(buf, 'a', bs);
+
+	if (!strcmp(workload, "append"))
+		ret = run_append(root);
+	else if (!strcmp(workload, "churn"))
+		ret = run_churn(root);
+	else if (!strcmp(workload, "evict"))
+		ret = run_evict(root);
+	else if (!strcmp(workload, "populate"))
+		ret = run_populate(root);
+	else if (!strcmp(workload, "readdir"))
+		ret = run_readdir(root);
+	else
+		goto usage;
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr,
+		"Usage: %s [-f files] [-d dirs] [-n ops] [-b bs_KiB] [-F file_size_KiB] [-s size_MiB]\n"
+		"          append|churn|evict|populate|readdir dir\n",
+		argv[0]);
+	return EXIT_FAILURE;
+}
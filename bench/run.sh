@@ -0,0 +1,99 @@
+#!/bin/bash
+#
+# Benchmark suite for the rotating filesystem workloads: each workload runs on
+# a fresh ouichefs image mounted on a loop device, using the ouichefs-bench
+# driver. Results are printed on stdout as one JSON object per line (see
+# ouichefs-bench.c), followed for each workload by the eviction statistics of
+# the partition ("workload": "<name>-stats"). Must be run as root from the
+# repository root after building the module, mkfs and the driver
+# (make && make -C mkfs && make -C bench).
+#
+# Usage: bench/run.sh [-e] [-d] [-s image_size_MiB] [-r runs] [workload...]
+#   -e  format the images with extent trees (mkfs -e)
+#   -d  format the images with hashed directories (mkfs -d)
+#   -r  run each workload this many times (default 1)
+# Workloads: append churn evict readdir (default: all). Options after "--"
+# are passed to the driver, e.g. bench/run.sh -d churn -- -f 4096.
+
+set -e
+
+MKFS_OPTS=""
+IMG_SIZE=512
+RUNS=1
+IMG=$(mktemp --suffix=.img /tmp/ouichefs-bench.XXXXXX)
+MNT=$(mktemp -d /tmp/ouichefs-bench.XXXXXX)
+LOOP=""
+DRIVER=bench/ouichefs-bench
+
+while getopts "eds:r:" opt; do
+	case $opt in
+	e) MKFS_OPTS="$MKFS_OPTS -e" ;;
+	d) MKFS_OPTS="$MKFS_OPTS -d" ;;
+	s) IMG_SIZE=$OPTARG ;;
+	r) RUNS=$OPTARG ;;
+	*) exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+WORKLOADS=""
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+	WORKLOADS="$WORKLOADS $1"
+	shift
+done
+[ "$1" = "--" ] && shift
+WORKLOADS=${WORKLOADS:-append churn evict readdir}
+
+cleanup() {
+	mountpoint -q "$MNT" && umount "$MNT"
+	[ -n "$LOOP" ] && losetup -d "$LOOP"
+	rm -rf "$IMG" "$MNT"
+}
+trap cleanup EXIT
+
+fs_mount() {
+	LOOP=$(losetup -f --show "$IMG")
+	mount -t ouichefs "$LOOP" "$MNT"
+}
+
+fs_umount() {
+	umount "$MNT"
+	losetup -d "$LOOP"
+	LOOP=""
+}
+
+# Print the single value files of /sys/kernel/ouichefs/<device>/ as JSON
+print_stats() {
+	local dir=/sys/kernel/ouichefs/$(basename "$LOOP") sep="" f
+
+	[ -d "$dir" ] || return 0
+	echo -n "{\"workload\": \"$1-stats\""
+	for f in "$dir"/*; do
+		[ "$(wc -l < "$f")" -eq 1 ] || continue
+		echo -n ", \"$(basename "$f")\": $(cat "$f")"
+	done
+	echo "}"
+}
+
+grep -q '^ouichefs ' /proc/modules || insmod ouichefs.ko
+
+for run in $(seq 1 "$RUNS"); do
+	for w in $WORKLOADS; do
+		dd if=/dev/zero of="$IMG" bs=1M count="$IMG_SIZE" status=none
+		mkfs/mkfs.ouichefs $MKFS_OPTS "$IMG" > /dev/null
+		fs_mount
+
+		if [ "$w" = "readdir" ]; then
+			# Remount and drop the caches so that readdir and
+			# lookups read everything from the device
+			$DRIVER "$@" populate "$MNT"
+			fs_umount
+			echo 3 > /proc/sys/vm/drop_caches
+			fs_mount
+		fi
+		$DRIVER "$@" "$w" "$MNT"
+		print_stats "$w"
+
+		fs_umount
+	done
+done
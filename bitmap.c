@@ -0,0 +1,293 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+#include "trace/events/ouichefs.h"
+
+/*
+ * The in-memory free bitmaps are split in chunks, one per on-disk bitmap block.
+ * A chunk is only read when an allocation or a free first needs it, so mounting
+ * doesn't read the bitmaps and the parts of a big partition that are never
+ * touched don't use any memory. Until its chunk is read, the free count of
+ * a group is 0.
+ */
+
+int ouichefs_bitmap_init(struct ouichefs_bitmap *bm, uint32_t size,
+			 uint32_t first_block, uint32_t nr_chunks)
+{
+	if (DIV_ROUND_UP(size, OUICHEFS_BITS_PER_BLOCK) > nr_chunks) {
+		pr_err("%u bitmap blocks can't hold %u bits\n", nr_chunks,
+		       size);
+		return -EINVAL;
+	}
+
+	bm->size = size;
+	bm->first_block = first_block;
+	bm->nr_chunks = nr_chunks;
+	bm->nr_groups = DIV_ROUND_UP(size, OUICHEFS_GROUP_BITS);
+	mutex_init(&bm->load_mutex);
+	mutex_init(&bm->sync_mutex);
+
+	bm->chunks = kvcalloc(nr_chunks, sizeof(*bm->chunks), GFP_KERNEL);
+	bm->dirty = bitmap_zalloc(nr_chunks, GFP_KERNEL);
+	bm->groups = kvcalloc(bm->nr_groups, sizeof(*bm->groups), GFP_KERNEL);
+	if (!bm->chunks || !bm->dirty || !bm->groups) {
+		ouichefs_bitmap_destroy(bm);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void ouichefs_bitmap_destroy(struct ouichefs_bitmap *bm)
+{
+	uint32_t c;
+
+	if (bm->chunks) {
+		for (c = 0; c < bm->nr_chunks; c++)
+			kfree(bm->chunks[c]);
+	}
+	kvfree(bm->chunks);
+	bitmap_free(bm->dirty);
+	kvfree(bm->groups);
+	bm->chunks = NULL;
+	bm->dirty = NULL;
+	bm->groups = NULL;
+}
+
+/*
+ * Return chunk c of a bitmap, reading it (and counting the free bits of its
+ * groups) if it was never used. Return NULL if it can't be read.
+ */
+static unsigned long *ouichefs_bitmap_chunk(struct super_block *sb,
+					    struct ouichefs_bitmap *bm,
+					    uint32_t c)
+{
+	struct buffer_head *bh;
+	unsigned long *chunk;
+	uint32_t g, first, last, start, nr;
+
+	chunk = smp_load_acquire(&bm->chunks[c]);
+	if (chunk)
+		return chunk;
+
+	mutex_lock(&bm->load_mutex);
+	chunk = bm->chunks[c];
+	if (chunk)
+		goto unlock;
+
+	bh = sb_bread(sb, bm->first_block + c);
+	if (!bh) {
+		pr_err("failed to read bitmap block %u\n",
+		       bm->first_block + c);
+		goto unlock;
+	}
+	/* Full groups spill over to the next chunk, get it on its way */
+	if (c + 1 < bm->nr_chunks && !bm->chunks[c + 1])
+		sb_breadahead(sb, bm->first_block + c + 1);
+
+	chunk = kmalloc(OUICHEFS_BLOCK_SIZE, GFP_NOFS);
+	if (!chunk)
+		goto release;
+	memcpy(chunk, bh->b_data, OUICHEFS_BLOCK_SIZE);
+
+	/* Nobody touches the groups before the chunk is published */
+	first = c * OUICHEFS_GROUPS_PER_CHUNK;
+	last = min(bm->nr_groups, first + OUICHEFS_GROUPS_PER_CHUNK);
+	for (g = first; g < last; g++) {
+		start = (g - first) * OUICHEFS_GROUP_BITS;
+		nr = min_t(uint32_t, bm->size - g * OUICHEFS_GROUP_BITS,
+			   OUICHEFS_GROUP_BITS);
+		atomic_set(&bm->groups[g].nr_free,
+			   bitmap_weight(chunk + start / BITS_PER_LONG, nr));
+	}
+	smp_store_release(&bm->chunks[c], chunk);
+
+release:
+	brelse(bh);
+unlock:
+	mutex_unlock(&bm->load_mutex);
+
+	return chunk;
+}
+
+/*
+ * Mark chunk c as changed, so that it is written back by the next sync. Must be
+ * called after the bits were changed.
+ */
+static void ouichefs_bitmap_dirty(struct ouichefs_bitmap *bm, uint32_t c)
+{
+	/* Order the bitmap update before the dirty bit */
+	smp_mb__before_atomic();
+	set_bit(c, bm->dirty);
+}
+
+/*
+ * Claim a run of at most max free bits (set to 1) in [start, end) of a chunk,
+ * looking from bit from and wrapping around to start, and clear them. The
+ * first bit of the run is returned in bit and its length in len.
+ * Return false if no free bit found.
+ */
+static bool ouichefs_claim_run(unsigned long *chunk, unsigned long start,
+			       unsigned long end, unsigned long from,
+			       uint32_t max, unsigned long *bit, uint32_t *len)
+{
+	unsigned long first, last, limit;
+
+	if (from < start || from >= end)
+		from = start;
+
+	/* Claim the first free bit, another task may take it before us */
+	do {
+		first = find_next_bit(chunk, end, from);
+		if (first >= end) {
+			first = find_next_bit(chunk, from, start);
+			if (first >= from)
+				return false;
+		}
+		from = first;
+	} while (!test_and_clear_bit(first, chunk));
+
+	/* Then extend the run with the following free bits */
+	limit = min(end, first + max);
+	for (last = first + 1; last < limit; last++) {
+		if (!test_and_clear_bit(last, chunk))
+			break;
+	}
+	*bit = first;
+	*len = last - first;
+
+	return true;
+}
+
+uint32_t ouichefs_bitmap_alloc(struct super_block *sb,
+			       struct ouichefs_bitmap *bm, uint32_t goal,
+			       uint32_t max, uint32_t *len)
+{
+	struct ouichefs_group *grp;
+	unsigned long *chunk, base, start, end, from, bit;
+	uint32_t c, g, i;
+
+	if (goal && goal < bm->size) {
+		g = goal / OUICHEFS_GROUP_BITS;
+	} else {
+		goal = 0;
+		g = div_u64((u64)raw_smp_processor_id() * bm->nr_groups,
+			    nr_cpu_ids);
+	}
+
+	for (i = 0; i < bm->nr_groups; i++, g = (g + 1) % bm->nr_groups) {
+		grp = &bm->groups[g];
+		c = g / OUICHEFS_GROUPS_PER_CHUNK;
+		chunk = ouichefs_bitmap_chunk(sb, bm, c);
+		if (!chunk || !atomic_read(&grp->nr_free))
+			continue;
+
+		/* Bits of the group, relative to the chunk */
+		base = (unsigned long)c * OUICHEFS_BITS_PER_BLOCK;
+		start = (unsigned long)g * OUICHEFS_GROUP_BITS - base;
+		end = min_t(unsigned long, bm->size - base,
+			    start + OUICHEFS_GROUP_BITS);
+		if (!i && goal)
+			from = goal - base;
+		else
+			from = start + READ_ONCE(grp->hint);
+		if (!ouichefs_claim_run(chunk, start, end, from, max, &bit,
+					len))
+			continue;
+
+		atomic_sub(*len, &grp->nr_free);
+		WRITE_ONCE(grp->hint, bit + *len - start);
+		ouichefs_bitmap_dirty(bm, c);
+		return base + bit;
+	}
+
+	return 0;
+}
+
+int ouichefs_bitmap_free(struct super_block *sb, struct ouichefs_bitmap *bm,
+			 uint32_t bit)
+{
+	uint32_t c = bit / OUICHEFS_BITS_PER_BLOCK;
+	unsigned long *chunk;
+
+	if (bit >= bm->size)
+		return -EINVAL;
+
+	chunk = ouichefs_bitmap_chunk(sb, bm, c);
+	if (!chunk)
+		return -EIO;
+
+	/* Freeing a free bit would let two files share it later */
+	if (WARN_ON_ONCE(test_and_set_bit(bit % OUICHEFS_BITS_PER_BLOCK,
+					  chunk)))
+		return -EINVAL;
+
+	atomic_inc(&bm->groups[bit / OUICHEFS_GROUP_BITS].nr_free);
+	ouichefs_bitmap_dirty(bm, c);
+
+	return 0;
+}
+
+int ouichefs_bitmap_sync(struct super_block *sb, struct ouichefs_bitmap *bm,
+			 int wait)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	unsigned long *chunk;
+	uint32_t c, flushed = 0;
+	int ret = 0;
+
+	/*
+	 * A concurrent sync could have cleared the dirty bit of a chunk it is
+	 * still writing, we must not return before it is on disk.
+	 */
+	mutex_lock(&bm->sync_mutex);
+	for (c = 0; c < bm->nr_chunks; c++) {
+		/*
+		 * Clear the dirty bit before copying the chunk: a bit changed
+		 * after the copy dirties the chunk again. Chunks that were
+		 * never read are never dirty.
+		 */
+		if (!test_and_clear_bit(c, bm->dirty)) {
+			atomic_long_inc(&sbi->bitmap_skipped);
+			continue;
+		}
+		chunk = smp_load_acquire(&bm->chunks[c]);
+
+		bh = sb_bread(sb, bm->first_block + c);
+		if (!bh) {
+			set_bit(c, bm->dirty);
+			ret = -EIO;
+			break;
+		}
+
+		memcpy(bh->b_data, chunk, OUICHEFS_BLOCK_SIZE);
+
+		mark_buffer_dirty(bh);
+		if (wait)
+			sync_dirty_buffer(bh);
+		brelse(bh);
+		atomic_long_inc(&sbi->bitmap_flushed);
+		flushed++;
+	}
+
+	mutex_unlock(&bm->sync_mutex);
+
+	trace_ouichefs_bitmap_sync(sb, bm == &sbi->ifree, flushed,
+				   c - flushed, wait, ret);
+
+	return ret;
+}
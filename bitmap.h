@@ -8,110 +8,180 @@
 #define _OUICHEFS_BITMAP_H
 
 #include <linux/bitmap.h>
+#include <linux/math64.h>
 #include "ouichefs.h"
 #include "eviction_tracker.h"
 #include "inode.h"
+#include "trace/events/ouichefs.h"
 
 extern int eviction_percentage_threshold;
+extern int eviction_low_watermark;
+extern int eviction_high_watermark;
 
 /*
- * Return the first free bit (set to 1) in a given in-memory bitmap spanning
- * over multiple blocks and clear it.
- * Return 0 if no free bit found (we assume that the first bit is never free
- * because of the superblock and the root inode, thus allowing us to use 0 as an
- * error value).
+ * The bitmaps (see bitmap.c) and free counters are not protected by a lock:
+ * bits are claimed and released with atomic bit operations (the task that
+ * clears a free bit owns the inode or block) and the counters are atomic, so
+ * concurrent allocations never return the same inode or block.
+ * The global free counters are percpu counters: allocations and frees only
+ * write to a counter of the current CPU, and the hot paths (eviction
+ * thresholds, write checks) read an approximate value. Only statfs and the
+ * superblock sync compute the exact sum.
  */
-static inline uint32_t get_first_free_bit(unsigned long *freemap,
-					  unsigned long size)
+
+/* Approximate number of free blocks/inodes */
+static inline uint32_t ouichefs_nr_free_blocks(struct ouichefs_sb_info *sbi)
 {
-	uint32_t ino;
+	return percpu_counter_read_positive(&sbi->free_blocks);
+}
+
+static inline uint32_t ouichefs_nr_free_inodes(struct ouichefs_sb_info *sbi)
+{
+	return percpu_counter_read_positive(&sbi->free_inodes);
+}
 
-	ino = find_first_bit(freemap, size);
-	if (ino == size)
-		return 0;
+/* Is there any free inode/block left? Exact when close to none */
+static inline bool ouichefs_has_free(struct percpu_counter *counter)
+{
+	return percpu_counter_compare(counter, 0) > 0;
+}
 
-	bitmap_clear(freemap, ino, 1);
+/*
+ * Approximate number of blocks that are free or will be once the free worker
+ * released the blocks of the files destroyed recently.
+ */
+static inline uint32_t ouichefs_nr_available_blocks(
+	struct ouichefs_sb_info *sbi)
+{
+	return ouichefs_nr_free_blocks(sbi) +
+	       atomic_long_read(&sbi->pending_free_blocks);
+}
 
-	return ino;
+/*
+ * Return the percentage of free blocks in the filesystem, counting the blocks
+ * being released.
+ */
+static inline uint32_t ouichefs_free_blocks_percentage(
+	struct ouichefs_sb_info *sbi)
+{
+	return div_u64((u64)ouichefs_nr_available_blocks(sbi) * 100,
+		       sbi->nr_blocks);
 }
 
 /*
- * Return an unused inode number and mark it used.
+ * Return the number of blocks that must be freed to have at least pct % of
+ * free blocks.
+ */
+static inline uint32_t ouichefs_blocks_to_reach(struct ouichefs_sb_info *sbi,
+						int pct)
+{
+	uint32_t target = DIV_ROUND_UP_ULL((u64)sbi->nr_blocks * pct, 100);
+	uint32_t nr_free = ouichefs_nr_available_blocks(sbi);
+
+	return target > nr_free ? target - nr_free : 0;
+}
+
+int ouichefs_bitmap_init(struct ouichefs_bitmap *bm, uint32_t size,
+			 uint32_t first_block, uint32_t nr_chunks);
+void ouichefs_bitmap_destroy(struct ouichefs_bitmap *bm);
+
+/*
+ * Allocate a run of at most max bits from a bitmap. The search starts at goal
+ * if it is not 0, else in the group of the current CPU where its last
+ * allocation ended, and spills over to the following groups when a group is
+ * full. Groups never share a run. The length of the run is returned in len.
+ * Return the first bit of the run or 0 if no free bit found (we assume that the
+ * first bit is never free because of the superblock and the root inode, thus
+ * allowing us to use 0 as an error value).
+ */
+uint32_t ouichefs_bitmap_alloc(struct super_block *sb,
+			       struct ouichefs_bitmap *bm, uint32_t goal,
+			       uint32_t max, uint32_t *len);
+
+/* Mark a bit as free again, return 0 or a negative error code */
+int ouichefs_bitmap_free(struct super_block *sb, struct ouichefs_bitmap *bm,
+			 uint32_t bit);
+
+/* Write back the bitmap blocks changed since the last sync */
+int ouichefs_bitmap_sync(struct super_block *sb, struct ouichefs_bitmap *bm,
+			 int wait);
+
+/*
+ * Return an unused inode number and mark it used. The inode is taken close to
+ * goal (e.g. the inode of the parent directory) if possible, or in the group
+ * of the current CPU if goal is 0.
  * Return 0 if no free inode was found.
  */
-static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
+static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi,
+				      uint32_t goal)
 {
-	uint32_t ret;
+	uint32_t ret, len;
 
-	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes);
+	ret = ouichefs_bitmap_alloc(sbi->sb, &sbi->ifree, goal, 1, &len);
 	if (ret) {
-		sbi->nr_free_inodes--;
-		pr_debug("%s:%d: allocated inode %u\n", __func__, __LINE__,
-			 ret);
+		percpu_counter_dec(&sbi->free_inodes);
+		trace_ouichefs_get_free_inode(sbi->sb, ret);
 	}
 	return ret;
 }
 
 /*
- * Return an unused block number and mark it used.
+ * Return the first of at most max contiguous unused blocks and mark them used.
+ * The search starts at goal (e.g. the block following the previous block of a
+ * file) or, if goal is 0, where the last allocation of the group of the current
+ * CPU ended, so that concurrent writers don't allocate from the same part of
+ * the bitmap.
+ * The number of allocated blocks is returned in len.
  * Return 0 if no free block was found.
  */
-static inline uint32_t get_free_block(struct super_block *sb)
+static inline uint32_t get_free_blocks(struct super_block *sb, uint32_t goal,
+				       uint32_t max, uint32_t *len)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct inode *dir = d_inode(sb->s_root);
 	uint32_t ret;
 
-	while ((sbi->nr_free_blocks * 100) / sbi->nr_blocks <
+	/* Let the background worker free space before we run out of it */
+	if (ouichefs_free_blocks_percentage(sbi) < eviction_low_watermark)
+		eviction_tracker_wake_worker(sb);
+
+	/*
+	 * Emergency: the worker couldn't keep up, evict synchronously. If
+	 * nothing can be evicted we still try to use the remaining blocks.
+	 * Blocks still being released count as free: we rather wait for them
+	 * below than evict more files.
+	 */
+	while (ouichefs_free_blocks_percentage(sbi) <
 	       eviction_percentage_threshold) {
-		struct eviction_tracker_scan_result result;
-
-		if (!eviction_tracker_get_inode_for_eviction(dir, true,
-							     &result)) {
-			return -ENOENT;
-		}
+		uint32_t nr_needed = ouichefs_blocks_to_reach(
+			sbi, eviction_percentage_threshold);
 
-		pr_info("not enough blocks - evicting inode %ld\n",
-			result.best_candidate->i_ino);
-
-		ret = ouichefs_unlink_inode(result.parent,
-					    result.best_candidate);
-
-		if (ret < 0) {
-			pr_err("unlink of inode %ld failed\n",
-			       result.best_candidate->i_ino);
-			return ret;
-		}
-
-		/* See fs.c for lengthy explanation */
-		d_prune_aliases(result.best_candidate);
-
-		iput(result.best_candidate);
-		iput(result.parent);
+		if (eviction_tracker_evict(dir, true, false, nr_needed,
+					   EVICTION_TRIGGER_SPACE,
+					   "not enough blocks") < 0)
+			break;
 	}
 
-	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
-	if (ret) {
-		sbi->nr_free_blocks--;
-		pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__,
-			 ret);
+	ret = ouichefs_bitmap_alloc(sb, &sbi->bfree, goal, max, len);
+	if (!ret && atomic_long_read(&sbi->pending_free_blocks)) {
+		ouichefs_free_worker_flush(sb);
+		ret = ouichefs_bitmap_alloc(sb, &sbi->bfree, goal, max, len);
 	}
+	if (ret)
+		percpu_counter_sub(&sbi->free_blocks, *len);
+	trace_ouichefs_get_free_blocks(sb, goal, max, ret, *len);
 	return ret;
 }
 
 /*
- * Mark the i-th bit in freemap as free (i.e. 1)
+ * Return an unused block number and mark it used.
+ * Return 0 if no free block was found.
  */
-static inline int put_free_bit(unsigned long *freemap, unsigned long size,
-			       uint32_t i)
+static inline uint32_t get_free_block(struct super_block *sb)
 {
-	/* i is greater than freemap size */
-	if (i > size)
-		return -1;
-
-	bitmap_set(freemap, i, 1);
+	uint32_t len;
 
-	return 0;
+	return get_free_blocks(sb, 0, 1, &len);
 }
 
 /*
@@ -119,11 +189,11 @@ static inline int put_free_bit(unsigned long *freemap, unsigned long size,
  */
 static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
 {
-	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
+	if (ouichefs_bitmap_free(sbi->sb, &sbi->ifree, ino))
 		return;
 
-	sbi->nr_free_inodes++;
-	pr_debug("%s:%d: freed inode %u\n", __func__, __LINE__, ino);
+	percpu_counter_inc(&sbi->free_inodes);
+	trace_ouichefs_put_inode(sbi->sb, ino);
 }
 
 /*
@@ -131,11 +201,11 @@ static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
  */
 static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
 {
-	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
+	if (ouichefs_bitmap_free(sbi->sb, &sbi->bfree, bno))
 		return;
 
-	sbi->nr_free_blocks++;
-	pr_debug("%s:%d: freed block %u\n", __func__, __LINE__, bno);
+	percpu_counter_inc(&sbi->free_blocks);
+	trace_ouichefs_put_block(sbi->sb, bno);
 }
 
 #endif /* _OUICHEFS_BITMAP_H */
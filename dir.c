@@ -10,23 +10,708 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/jhash.h>
 
 #include "dir.h"
+#include "inode.h"
 #include "ouichefs.h"
+#include "bitmap.h"
 
-int ouichefs_iterate_inode(struct inode *dir, struct dir_context *ctx)
+/*
+ * Position of an entry of a hashed directory in ctx->pos (after . and ..):
+ * bucket, block in the bucket chain and slot in that block.
+ */
+#define OUICHEFS_DIR_POS(bucket, chain, slot) \
+	(((loff_t)(bucket) << 32) | ((loff_t)(chain) << 8) | (slot))
+#define OUICHEFS_DIR_POS_BUCKET(pos) ((pos) >> 32)
+#define OUICHEFS_DIR_POS_CHAIN(pos) (((pos) >> 8) & 0xffffff)
+#define OUICHEFS_DIR_POS_SLOT(pos) ((pos) & 0xff)
+
+static bool ouichefs_dir_hashed(struct inode *dir)
+{
+	return OUICHEFS_INODE(dir)->i_flags & OUICHEFS_IFLAG_HASHED;
+}
+
+/* Bucket of a file name, the hash is part of the on-disk format */
+static uint32_t ouichefs_dir_bucket(const char *name, unsigned int len)
+{
+	len = min_t(unsigned int, len, OUICHEFS_FILENAME_LEN);
+	return jhash(name, len, 0) % OUICHEFS_DIR_BUCKETS;
+}
+
+static bool ouichefs_dir_match(struct ouichefs_file *f, const char *name)
+{
+	return !strncmp(f->filename, name, OUICHEFS_FILENAME_LEN);
+}
+
+static void ouichefs_dir_set(struct ouichefs_file *f, const char *name,
+			     uint32_t ino)
+{
+	f->inode = ino;
+	strscpy(f->filename, name, OUICHEFS_FILENAME_LEN);
+}
+
+/* Number of used entries of a legacy directory block */
+static int ouichefs_dir_block_count(struct ouichefs_dir_block *dblock)
+{
+	int i;
+
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
+		if (!dblock->files[i].inode)
+			break;
+	return i;
+}
+
+/* Read the index block of a hashed directory */
+static struct buffer_head *
+ouichefs_dir_read_root(struct inode *dir, struct ouichefs_dir_hash_root **root)
+{
+	struct buffer_head *bh;
+
+	bh = ouichefs_index_bh(dir);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	*root = (struct ouichefs_dir_hash_root *)bh->b_data;
+	if ((*root)->magic != OUICHEFS_DIR_HASH_MAGIC) {
+		pr_err("corrupted hashed directory %lu\n", dir->i_ino);
+		brelse(bh);
+		return ERR_PTR(-EUCLEAN);
+	}
+	return bh;
+}
+
+/*
+ * Initialize the (scrubbed) index block of the new directory dir.
+ */
+void ouichefs_dir_init_block(struct inode *dir, void *block)
+{
+	struct ouichefs_dir_hash_root *root = block;
+
+	if (ouichefs_dir_hashed(dir))
+		root->magic = OUICHEFS_DIR_HASH_MAGIC;
+}
+
+/*
+ * Look for name in dir. Returns 0 and the inode number in ino if found,
+ * -ENOENT if not.
+ */
+int ouichefs_dir_lookup(struct inode *dir, const struct qstr *name,
+			uint32_t *ino)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_hash_root *root;
+	struct ouichefs_dir_bucket *bucket;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	uint32_t bno;
+	int i, ret = -ENOENT;
+
+	if (!ouichefs_dir_hashed(dir)) {
+		bh = ouichefs_index_bh(dir);
+		if (!bh)
+			return -EIO;
+		dblock = (struct ouichefs_dir_block *)bh->b_data;
+		for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+			if (!dblock->files[i].inode)
+				break;
+			if (ouichefs_dir_match(&dblock->files[i], name->name)) {
+				*ino = dblock->files[i].inode;
+				ret = 0;
+				break;
+			}
+		}
+		brelse(bh);
+		return ret;
+	}
+
+	bh = ouichefs_dir_read_root(dir, &root);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	bno = root->buckets[ouichefs_dir_bucket(name->name, name->len)];
+	brelse(bh);
+
+	while (bno && ret == -ENOENT) {
+		bh = sb_bread(sb, bno);
+		if (!bh)
+			return -EIO;
+		bucket = (struct ouichefs_dir_bucket *)bh->b_data;
+		for (i = 0; i < bucket->nr_entries; i++) {
+			if (ouichefs_dir_match(&bucket->files[i], name->name)) {
+				*ino = bucket->files[i].inode;
+				ret = 0;
+				break;
+			}
+		}
+		bno = bucket->next;
+		brelse(bh);
+	}
+
+	return ret;
+}
+
+/*
+ * Add name (pointing to inode ino) to a hashed directory. Allocating a new
+ * bucket block may evict files, even from dir, so no block of dir is held
+ * while allocating: we look for a free slot again afterwards.
+ */
+static int ouichefs_dir_hashed_add(struct inode *dir, const struct qstr *name,
+				   uint32_t ino)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_hash_root *root;
+	struct ouichefs_dir_bucket *bucket = NULL;
+	struct buffer_head *bh_root, *bh = NULL, *bh_prev;
+	uint32_t h = ouichefs_dir_bucket(name->name, name->len);
+	uint32_t bno, spare = 0;
+	int ret = 0;
+
+again:
+	bh_root = ouichefs_dir_read_root(dir, &root);
+	if (IS_ERR(bh_root)) {
+		ret = PTR_ERR(bh_root);
+		goto put_spare;
+	}
+
+	/* Find the first block of the chain with a free slot */
+	bh_prev = NULL;
+	for (bno = root->buckets[h]; bno; bno = bucket->next) {
+		bh = sb_bread(sb, bno);
+		if (!bh) {
+			ret = -EIO;
+			goto release;
+		}
+		bucket = (struct ouichefs_dir_bucket *)bh->b_data;
+		if (bucket->nr_entries < OUICHEFS_BUCKET_FILES)
+			break;
+		brelse(bh_prev);
+		bh_prev = bh;
+		bh = NULL;
+	}
+
+	if (!bh) {
+		/* Chain is full, allocate a new block and append it */
+		if (!spare) {
+			brelse(bh_prev);
+			brelse(bh_root);
+			spare = get_free_block(sb);
+			if (!spare)
+				return -ENOSPC;
+			goto again;
+		}
+		bh = sb_bread(sb, spare);
+		if (!bh) {
+			ret = -EIO;
+			goto release;
+		}
+		memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+		bucket = (struct ouichefs_dir_bucket *)bh->b_data;
+		if (bh_prev) {
+			((struct ouichefs_dir_bucket *)bh_prev->b_data)->next =
+				spare;
+			mark_buffer_dirty_inode(bh_prev, dir);
+		} else {
+			root->buckets[h] = spare;
+		}
+		spare = 0;
+		dir->i_blocks++;
+		dir->i_size += OUICHEFS_BLOCK_SIZE;
+	}
+
+	ouichefs_dir_set(&bucket->files[bucket->nr_entries++], name->name,
+			 ino);
+	mark_buffer_dirty_inode(bh, dir);
+	root->nr_entries++;
+	mark_buffer_dirty_inode(bh_root, dir);
+
+release:
+	brelse(bh);
+	brelse(bh_prev);
+	brelse(bh_root);
+put_spare:
+	if (spare)
+		put_block(OUICHEFS_SB(sb), spare);
+
+	return ret;
+}
+
+/*
+ * Add name (pointing to inode ino) to dir. Fails with -EMLINK if a legacy
+ * directory is full. The caller updates the directory times.
+ */
+int ouichefs_dir_add(struct inode *dir, const struct qstr *name, uint32_t ino)
+{
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	int i;
+
+	if (ouichefs_dir_hashed(dir))
+		return ouichefs_dir_hashed_add(dir, name, ino);
+
+	bh = ouichefs_index_bh(dir);
+	if (!bh)
+		return -EIO;
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+
+	/* Find first free slot in the directory */
+	i = ouichefs_dir_block_count(dblock);
+	if (i == OUICHEFS_MAX_SUBFILES) {
+		brelse(bh);
+		return -EMLINK;
+	}
+	ouichefs_dir_set(&dblock->files[i], name->name, ino);
+	mark_buffer_dirty_inode(bh, dir);
+	brelse(bh);
+
+	return 0;
+}
+
+/*
+ * Remove the entry name (pointing to inode ino) from dir. Returns -ENOENT if
+ * there is no such entry.
+ */
+int ouichefs_dir_remove(struct inode *dir, const struct qstr *name,
+			uint32_t ino)
 {
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
 	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_hash_root *root;
+	struct ouichefs_dir_bucket *bucket;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh, *bh_root;
+	uint32_t bno;
+	int i, nr;
+
+	if (!ouichefs_dir_hashed(dir)) {
+		bh = ouichefs_index_bh(dir);
+		if (!bh)
+			return -EIO;
+		dblock = (struct ouichefs_dir_block *)bh->b_data;
+		nr = ouichefs_dir_block_count(dblock);
+		for (i = 0; i < nr; i++)
+			if (dblock->files[i].inode == ino &&
+			    ouichefs_dir_match(&dblock->files[i], name->name))
+				break;
+		if (i == nr) {
+			brelse(bh);
+			return -ENOENT;
+		}
+		memmove(&dblock->files[i], &dblock->files[i + 1],
+			(nr - i - 1) * sizeof(struct ouichefs_file));
+		memset(&dblock->files[nr - 1], 0, sizeof(struct ouichefs_file));
+		mark_buffer_dirty_inode(bh, dir);
+		brelse(bh);
+		return 0;
+	}
+
+	bh_root = ouichefs_dir_read_root(dir, &root);
+	if (IS_ERR(bh_root))
+		return PTR_ERR(bh_root);
+
+	for (bno = root->buckets[ouichefs_dir_bucket(name->name, name->len)];
+	     bno; bno = bucket->next, brelse(bh)) {
+		bh = sb_bread(sb, bno);
+		if (!bh)
+			break;
+		bucket = (struct ouichefs_dir_bucket *)bh->b_data;
+		nr = bucket->nr_entries;
+		for (i = 0; i < nr; i++)
+			if (bucket->files[i].inode == ino &&
+			    ouichefs_dir_match(&bucket->files[i], name->name))
+				break;
+		if (i == nr)
+			continue;
+
+		memmove(&bucket->files[i], &bucket->files[i + 1],
+			(nr - i - 1) * sizeof(struct ouichefs_file));
+		memset(&bucket->files[nr - 1], 0, sizeof(struct ouichefs_file));
+		bucket->nr_entries--;
+		mark_buffer_dirty_inode(bh, dir);
+		brelse(bh);
+
+		root->nr_entries--;
+		mark_buffer_dirty_inode(bh_root, dir);
+		brelse(bh_root);
+		return 0;
+	}
+	brelse(bh_root);
+
+	return bno ? -EIO : -ENOENT;
+}
+
+/*
+ * Rename the entry old_name (pointing to inode ino) of dir to new_name.
+ */
+int ouichefs_dir_rename(struct inode *dir, const struct qstr *old_name,
+			const struct qstr *new_name, uint32_t ino)
+{
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	int i, ret;
+
+	/* The name decides the bucket, move the entry */
+	if (ouichefs_dir_hashed(dir)) {
+		ret = ouichefs_dir_add(dir, new_name, ino);
+		if (ret)
+			return ret;
+		ret = ouichefs_dir_remove(dir, old_name, ino);
+		if (ret)
+			ouichefs_dir_remove(dir, new_name, ino);
+		return ret;
+	}
+
+	bh = ouichefs_index_bh(dir);
+	if (!bh)
+		return -EIO;
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	ret = -ENOENT;
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+		if (!dblock->files[i].inode)
+			break;
+		if (dblock->files[i].inode == ino &&
+		    ouichefs_dir_match(&dblock->files[i], old_name->name)) {
+			ouichefs_dir_set(&dblock->files[i], new_name->name,
+					 ino);
+			mark_buffer_dirty_inode(bh, dir);
+			ret = 0;
+			break;
+		}
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Remove one entry per inode from the nr (used) entries of files and keep the
+ * remaining entries packed at the start. Inodes found are recorded in found.
+ * Returns the new number of used entries.
+ * This is problematic:
+ * We only check for inode ID not for the name
+ * If a directory contains 2 hardlinks to the same inode
+ * we will possibly remove the wrong one.
+ * We'd need some check to see if the name matches
+ * the dentry name
+ * but we don't have access to the dentry here
+ */
+static int ouichefs_dir_compact(struct ouichefs_file *files, int nr,
+				struct inode **inodes, int nr_inodes,
+				unsigned long *found)
+{
+	int i, j, k;
+
+	for (i = 0, j = 0; i < nr; i++) {
+		for (k = 0; k < nr_inodes; k++) {
+			if (!(*found & BIT(k)) &&
+			    inodes[k]->i_ino == files[i].inode) {
+				*found |= BIT(k);
+				break;
+			}
+		}
+		if (k < nr_inodes)
+			continue;
+
+		if (i != j)
+			files[j] = files[i];
+		j++;
+	}
+
+	/* Clear the slots freed at the end */
+	if (j < nr)
+		memset(&files[j], 0, (nr - j) * sizeof(struct ouichefs_file));
+
+	return j;
+}
+
+/*
+ * Remove one entry of dir for each of the nr inodes (at most BITS_PER_LONG).
+ * names (can be NULL) holds the names of the inodes in dir, padded like in
+ * directory blocks, or an empty string if unknown. A known name is only
+ * looked up in its own bucket, the other inodes (and those not found under
+ * their name, e.g. because it is stale) are removed whatever their name. Bit
+ * k of found is set if inodes[k] was found.
+ */
+int ouichefs_dir_remove_inodes(struct inode *dir, struct inode **inodes,
+			       const char **names, int nr,
+			       unsigned long *found)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_hash_root *root;
+	struct ouichefs_dir_bucket *bucket;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh, *bh_root;
+	unsigned long all = nr ? GENMASK(nr - 1, 0) : 0;
+	struct qstr name;
+	uint32_t bno, h;
+	int k, nr_subs, nr_left, ret = 0;
+
+	*found = 0;
+
+	for (k = 0; names && k < nr; k++) {
+		if (!names[k][0])
+			continue;
+		name.name = names[k];
+		name.len = strnlen(names[k], OUICHEFS_FILENAME_LEN);
+		ret = ouichefs_dir_remove(dir, &name, inodes[k]->i_ino);
+		if (!ret)
+			*found |= BIT(k);
+		else if (ret != -ENOENT)
+			return ret;
+	}
+	if (*found == all)
+		return 0;
+	ret = 0;
+
+	if (!ouichefs_dir_hashed(dir)) {
+		bh = ouichefs_index_bh(dir);
+		if (!bh)
+			return -EIO;
+		dblock = (struct ouichefs_dir_block *)bh->b_data;
+		nr_subs = ouichefs_dir_block_count(dblock);
+		nr_left = ouichefs_dir_compact(dblock->files, nr_subs, inodes,
+					       nr, found);
+		if (nr_left < nr_subs)
+			mark_buffer_dirty_inode(bh, dir);
+		brelse(bh);
+		return 0;
+	}
+
+	/* Some names are unknown, look at every bucket */
+	bh_root = ouichefs_dir_read_root(dir, &root);
+	if (IS_ERR(bh_root))
+		return PTR_ERR(bh_root);
+
+	for (h = 0; h < OUICHEFS_DIR_BUCKETS && *found != all; h++) {
+		for (bno = root->buckets[h]; bno && *found != all;
+		     bno = bucket->next, brelse(bh)) {
+			bh = sb_bread(sb, bno);
+			if (!bh) {
+				ret = -EIO;
+				goto brelse_root;
+			}
+			bucket = (struct ouichefs_dir_bucket *)bh->b_data;
+			nr_subs = bucket->nr_entries;
+			nr_left = ouichefs_dir_compact(bucket->files, nr_subs,
+						       inodes, nr, found);
+			if (nr_left == nr_subs)
+				continue;
+			bucket->nr_entries = nr_left;
+			root->nr_entries -= nr_subs - nr_left;
+			mark_buffer_dirty_inode(bh, dir);
+			mark_buffer_dirty_inode(bh_root, dir);
+		}
+	}
+
+brelse_root:
+	brelse(bh_root);
+
+	return ret;
+}
+
+/*
+ * Number of files in dir (without . and ..), or a negative error code.
+ */
+int ouichefs_dir_nr_entries(struct inode *dir)
+{
+	struct ouichefs_dir_hash_root *root;
+	struct buffer_head *bh;
+	int nr;
+
+	if (ouichefs_dir_hashed(dir)) {
+		bh = ouichefs_dir_read_root(dir, &root);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		nr = root->nr_entries;
+	} else {
+		bh = ouichefs_index_bh(dir);
+		if (!bh)
+			return -EIO;
+		nr = ouichefs_dir_block_count(
+			(struct ouichefs_dir_block *)bh->b_data);
+	}
+	brelse(bh);
+
+	return nr;
+}
+
+/*
+ * Check if dir reached the number of files above which a file must be evicted
+ * before adding a new one: the dir_max_entries module parameter, and the
+ * capacity of the single block of legacy directories.
+ */
+bool ouichefs_dir_full(struct inode *dir)
+{
+	int limit = dir_max_entries;
+	int nr = ouichefs_dir_nr_entries(dir);
+
+	/* Let the caller fail on the I/O error */
+	if (nr < 0)
+		return false;
+
+	if (!ouichefs_dir_hashed(dir) &&
+	    (!limit || limit > OUICHEFS_MAX_SUBFILES))
+		limit = OUICHEFS_MAX_SUBFILES;
+
+	return limit && nr >= limit;
+}
+
+/*
+ * Free the bucket blocks of the directory dir whose last link was removed,
+ * block is its index block (left to the caller).
+ */
+void ouichefs_dir_release(struct inode *dir, void *block)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_hash_root *root = block;
+	struct buffer_head *bh;
+	uint32_t h, bno, next;
+
+	if (!ouichefs_dir_hashed(dir))
+		return;
+	if (root->magic != OUICHEFS_DIR_HASH_MAGIC) {
+		pr_err("corrupted hashed directory %lu, its blocks are lost\n",
+		       dir->i_ino);
+		return;
+	}
+
+	for (h = 0; h < OUICHEFS_DIR_BUCKETS; h++) {
+		for (bno = root->buckets[h]; bno; bno = next) {
+			bh = sb_bread(sb, bno);
+			next = bh ? ((struct ouichefs_dir_bucket *)bh->b_data)
+					    ->next :
+				    0;
+			brelse(bh);
+			ouichefs_free_data_blocks(sb, bno, 1);
+		}
+	}
+}
+
+/*
+ * Start reading the inode store blocks of the nr files of a directory block,
+ * so that callers getting their inodes one after the other (eviction scans,
+ * ls -l) don't wait for each block in turn. If subdirs is set, also wait for
+ * these blocks and start reading the index blocks of the subdirectories, which
+ * a recursive scan reads next. Entries of a directory usually have close inode
+ * numbers, so we only skip a block already requested for the previous entry.
+ */
+static void ouichefs_dir_readahead(struct super_block *sb,
+				   struct ouichefs_file *files, int nr,
+				   bool subdirs)
+{
+	struct buffer_head *bh = NULL;
+	struct ouichefs_inode *cinode;
+	uint32_t block, last = 0;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		block = files[i].inode / OUICHEFS_INODES_PER_BLOCK + 1;
+		if (block != last)
+			sb_breadahead(sb, block);
+		last = block;
+	}
+
+	if (!subdirs)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		block = files[i].inode / OUICHEFS_INODES_PER_BLOCK + 1;
+		if (!bh || bh->b_blocknr != block) {
+			brelse(bh);
+			bh = sb_bread(sb, block);
+			if (!bh)
+				return;
+		}
+		cinode = (struct ouichefs_inode *)bh->b_data +
+			 files[i].inode % OUICHEFS_INODES_PER_BLOCK;
+		if (S_ISDIR(le32_to_cpu(cinode->i_mode)) && cinode->index_block)
+			sb_breadahead(sb, le32_to_cpu(cinode->index_block));
+	}
+	brelse(bh);
+}
+
+static int ouichefs_iterate_hashed(struct inode *dir, struct dir_context *ctx,
+				   bool readahead_dirs)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_hash_root *root;
+	struct ouichefs_dir_bucket *bucket;
+	struct ouichefs_file *f;
+	struct buffer_head *bh_root, *bh;
+	loff_t pos = ctx->pos - 2;
+	uint32_t h = OUICHEFS_DIR_POS_BUCKET(pos);
+	uint32_t chain = OUICHEFS_DIR_POS_CHAIN(pos);
+	uint32_t slot = OUICHEFS_DIR_POS_SLOT(pos);
+	uint32_t bno, i;
+	int ret = 0;
+
+	if (h >= OUICHEFS_DIR_BUCKETS)
+		return 0;
+
+	bh_root = ouichefs_dir_read_root(dir, &root);
+	if (IS_ERR(bh_root))
+		return PTR_ERR(bh_root);
+
+	for (; h < OUICHEFS_DIR_BUCKETS; h++, chain = 0, slot = 0) {
+		for (bno = root->buckets[h], i = 0; bno; i++) {
+			bh = sb_bread(sb, bno);
+			if (!bh) {
+				ret = -EIO;
+				goto brelse_root;
+			}
+			bucket = (struct ouichefs_dir_bucket *)bh->b_data;
+			bno = bucket->next;
+			if (i >= chain && slot < bucket->nr_entries)
+				ouichefs_dir_readahead(
+					sb, &bucket->files[slot],
+					bucket->nr_entries - slot,
+					readahead_dirs);
+
+			/* Skip the blocks already done */
+			for (; i >= chain && slot < bucket->nr_entries;
+			     slot++) {
+				f = &bucket->files[slot];
+				if (!dir_emit(ctx, f->filename,
+					      strnlen(f->filename,
+						      OUICHEFS_FILENAME_LEN),
+					      f->inode, DT_UNKNOWN)) {
+					brelse(bh);
+					goto brelse_root;
+				}
+				ctx->pos = 2 + OUICHEFS_DIR_POS(h, i, slot + 1);
+			}
+			if (i >= chain) {
+				chain = i + 1;
+				slot = 0;
+			}
+			brelse(bh);
+		}
+	}
+	ctx->pos = 2 + OUICHEFS_DIR_POS(OUICHEFS_DIR_BUCKETS, 0, 0);
+
+brelse_root:
+	brelse(bh_root);
+
+	return ret;
+}
+
+/*
+ * Emit the files of dir in ctx from ctx->pos. The inode store blocks of the
+ * files are read ahead, and with readahead_dirs the index blocks of the
+ * subdirectories too (see ouichefs_dir_readahead()).
+ */
+int ouichefs_iterate_inode(struct inode *dir, struct dir_context *ctx,
+			   bool readahead_dirs)
+{
 	struct buffer_head *bh = NULL;
 	struct ouichefs_dir_block *dblock = NULL;
 	struct ouichefs_file *f = NULL;
-	int i;
+	int i, nr;
 
 	/* Check that dir is a directory */
 	if (!S_ISDIR(dir->i_mode))
 		return -ENOTDIR;
 
+	if (ouichefs_dir_hashed(dir))
+		return ouichefs_iterate_hashed(dir, ctx, readahead_dirs);
+
 	/*
 	 * Check that ctx->pos is not bigger than what we can handle (including
 	 * . and ..)
@@ -35,10 +720,14 @@ int ouichefs_iterate_inode(struct inode *dir, struct dir_context *ctx)
 		return 0;
 
 	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci->index_block);
+	bh = ouichefs_index_bh(dir);
 	if (!bh)
 		return -EIO;
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	nr = ouichefs_dir_block_count(dblock);
+	if (ctx->pos - 2 < nr)
+		ouichefs_dir_readahead(dir->i_sb, &dblock->files[ctx->pos - 2],
+				       nr - (ctx->pos - 2), readahead_dirs);
 
 	/* Iterate over the index block and commit subfiles */
 	for (i = ctx->pos - 2; i < OUICHEFS_MAX_SUBFILES; i++) {
@@ -68,10 +757,11 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 	if (!dir_emit_dots(dir, ctx))
 		return 0;
 
-	return ouichefs_iterate_inode(inode, ctx);
+	return ouichefs_iterate_inode(inode, ctx, false);
 }
 
 const struct file_operations ouichefs_dir_ops = {
 	.owner = THIS_MODULE,
 	.iterate_shared = ouichefs_iterate,
+	.fsync = ouichefs_fsync,
 };
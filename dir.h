@@ -1,5 +1,24 @@
 #ifndef _DIR_H
 #define _DIR_H
-int ouichefs_iterate_inode(struct inode *dir, struct dir_context *ctx);
+
+/* Number of files of a directory above which we evict on create (0: none) */
+extern int dir_max_entries;
+
+int ouichefs_iterate_inode(struct inode *dir, struct dir_context *ctx,
+			   bool readahead_dirs);
+void ouichefs_dir_init_block(struct inode *dir, void *block);
+int ouichefs_dir_lookup(struct inode *dir, const struct qstr *name,
+			uint32_t *ino);
+int ouichefs_dir_add(struct inode *dir, const struct qstr *name, uint32_t ino);
+int ouichefs_dir_remove(struct inode *dir, const struct qstr *name,
+			uint32_t ino);
+int ouichefs_dir_rename(struct inode *dir, const struct qstr *old_name,
+			const struct qstr *new_name, uint32_t ino);
+int ouichefs_dir_remove_inodes(struct inode *dir, struct inode **inodes,
+			       const char **names, int nr,
+			       unsigned long *found);
+int ouichefs_dir_nr_entries(struct inode *dir);
+bool ouichefs_dir_full(struct inode *dir);
+void ouichefs_dir_release(struct inode *dir, void *block);
 
 #endif
@@ -3,15 +3,59 @@
 
 #include <linux/fs.h>
 
+/*
+ * Events after which the score of a file might change. The VFS doesn't tell
+ * which attribute changed when an inode is dirtied, so a policy declaring any
+ * of the attribute events is scored again every time the inode is dirtied.
+ */
+#define EVICTION_EVENT_ATIME (1U << 0)
+#define EVICTION_EVENT_MTIME (1U << 1)
+#define EVICTION_EVENT_CTIME (1U << 2)
+#define EVICTION_EVENT_SIZE (1U << 3)
+/* The file is opened or closed (it still counts as open during close) */
+#define EVICTION_EVENT_OPEN (1U << 4)
+
+#define EVICTION_EVENT_ATTRS                                            \
+	(EVICTION_EVENT_ATIME | EVICTION_EVENT_MTIME | EVICTION_EVENT_CTIME | \
+	 EVICTION_EVENT_SIZE)
+
+/*
+ * Attributes of a file given to the policies. They are copied from the inode,
+ * or read from the inode store during raw scans (then the timestamps have no
+ * nanoseconds), so that files don't need to be in the inode cache.
+ */
+struct eviction_candidate_attrs {
+	unsigned long ino;
+	loff_t size;
+	blkcnt_t blocks;
+	struct timespec64 atime;
+	struct timespec64 mtime;
+	struct timespec64 ctime;
+	unsigned int nlink;
+	umode_t mode;
+};
+
 /* Interface for eviction policies */
 struct eviction_policy {
 	/*
-	 * Function pointer that compares two inodes regarding eviction priority
+	 * Function pointer that compares two files regarding eviction priority
 	 * (higher value means higher priority)
-	 * Should return 1 if inode1 has higher priority
+	 * Should return 1 if file1 has higher priority
 	 * 0 if they have the same priority
-	 * and -1 if inode2 has higher priority
+	 * and -1 if file2 has higher priority
+	 */
+	int (*compare)(const struct eviction_candidate_attrs *file1,
+		       const struct eviction_candidate_attrs *file2);
+	/*
+	 * Optional function pointer that returns the eviction priority of a
+	 * file as a score (higher value means higher priority), consistent
+	 * with compare. It may only depend on the attributes changed by the
+	 * events below. Policies with a score can be evicted from a sorted
+	 * index, the others scan the filesystem on every eviction. It must not
+	 * sleep, it is called under spinlocks and RCU.
 	 */
-	int (*compare)(struct inode *inode1, struct inode *inode2);
+	u64 (*score)(const struct eviction_candidate_attrs *file);
+	/* EVICTION_EVENT_* after which score must be called again */
+	unsigned int events;
 };
 #endif
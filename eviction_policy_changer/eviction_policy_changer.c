@@ -1,15 +1,16 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 
-#include "../eviction_tracker.h"
+#include "../ouichefs.h"
 
-static int compare_largest_file(struct inode *inode1, struct inode *inode2)
+static int compare_largest_file(const struct eviction_candidate_attrs *file1,
+				const struct eviction_candidate_attrs *file2)
 {
 	printk(KERN_INFO "my eviction_policy_compare called - success!\n");
 
-	if (inode1->i_size > inode2->i_size)
+	if (file1->size > file2->size)
 		return 1;
-	else if (inode1->i_size < inode2->i_size)
+	else if (file1->size < file2->size)
 		return -1;
 	else
 		return 0;
@@ -1,10 +1,12 @@
 #ifndef _EVICTION_POLICY_EXAMPLES_H
 #define _EVICTION_POLICY_EXAMPLES_H
 
+#include <linux/ktime.h>
+
 #include "eviction_policy.h"
 
-static int compare_timespec(struct timespec64 *timespec1,
-			    struct timespec64 *timespec2)
+static int compare_timespec(const struct timespec64 *timespec1,
+			    const struct timespec64 *timespec2)
 {
 	if (timespec1->tv_sec > timespec2->tv_sec)
 		return -1;
@@ -18,48 +20,89 @@ static int compare_timespec(struct timespec64 *timespec1,
 		return 0;
 }
 
-static int compare_least_recently_accessed(struct inode *inode1,
-					   struct inode *inode2)
+/* Score of a timestamp for policies evicting the oldest files first */
+static u64 score_oldest(const struct timespec64 *timespec)
+{
+	return (u64)KTIME_MAX - (u64)timespec64_to_ns(timespec);
+}
+
+static int
+compare_least_recently_accessed(const struct eviction_candidate_attrs *file1,
+				const struct eviction_candidate_attrs *file2)
 {
-	return compare_timespec(&inode1->i_atime, &inode2->i_atime);
+	return compare_timespec(&file1->atime, &file2->atime);
+}
+
+static u64
+score_least_recently_accessed(const struct eviction_candidate_attrs *file)
+{
+	return score_oldest(&file->atime);
 }
 
 struct eviction_policy eviction_policy_least_recently_accessed = {
 	.compare = compare_least_recently_accessed,
+	.score = score_least_recently_accessed,
+	.events = EVICTION_EVENT_ATIME,
 };
 
-static int compare_least_recenty_modified(struct inode *inode1,
-					  struct inode *inode2)
+static int
+compare_least_recenty_modified(const struct eviction_candidate_attrs *file1,
+			       const struct eviction_candidate_attrs *file2)
+{
+	return compare_timespec(&file1->mtime, &file2->mtime);
+}
+
+static u64
+score_least_recently_modified(const struct eviction_candidate_attrs *file)
 {
-	return compare_timespec(&inode1->i_mtime, &inode2->i_mtime);
+	return score_oldest(&file->mtime);
 }
 
 struct eviction_policy eviction_policy_least_recently_modified = {
 	.compare = compare_least_recenty_modified,
+	.score = score_least_recently_modified,
+	.events = EVICTION_EVENT_MTIME,
 };
 
-static int compare_least_recently_created(struct inode *inode1,
-					  struct inode *inode2)
+static int
+compare_least_recently_created(const struct eviction_candidate_attrs *file1,
+			       const struct eviction_candidate_attrs *file2)
+{
+	return compare_timespec(&file1->ctime, &file2->ctime);
+}
+
+static u64
+score_least_recently_created(const struct eviction_candidate_attrs *file)
 {
-	return compare_timespec(&inode1->i_ctime, &inode2->i_ctime);
+	return score_oldest(&file->ctime);
 }
 
 struct eviction_policy eviction_policy_least_recently_created = {
 	.compare = compare_least_recently_created,
+	.score = score_least_recently_created,
+	.events = EVICTION_EVENT_CTIME,
 };
 
-static int compare_largest_file(struct inode *inode1, struct inode *inode2)
+static int compare_largest_file(const struct eviction_candidate_attrs *file1,
+				const struct eviction_candidate_attrs *file2)
 {
-	if (inode1->i_size > inode2->i_size)
+	if (file1->size > file2->size)
 		return 1;
-	else if (inode1->i_size < inode2->i_size)
+	else if (file1->size < file2->size)
 		return -1;
 	else
 		return 0;
 }
 
+static u64 score_largest_file(const struct eviction_candidate_attrs *file)
+{
+	return file->size;
+}
+
 struct eviction_policy eviction_policy_largest_file = {
 	.compare = compare_largest_file,
+	.score = score_largest_file,
+	.events = EVICTION_EVENT_SIZE,
 };
 
 #endif
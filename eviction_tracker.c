@@ -1,9 +1,17 @@
 #include <linux/buffer_head.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
 
 #include "ouichefs.h"
 #include "eviction_tracker.h"
 #include "eviction_policy_examples.h"
 #include "dir.h"
+#include "inode.h"
+#include "bitmap.h"
+#include "trace/events/ouichefs.h"
+
+/* Number of times the worker retries to lock a busy parent directory */
+#define EVICTION_WORKER_MAX_RETRIES 100
 
 static struct eviction_policy *default_eviction_policy =
 	&eviction_policy_least_recently_accessed;
@@ -13,15 +21,504 @@ static struct eviction_policy *eviction_policy =
 	&eviction_policy_least_recently_accessed;
 static DEFINE_MUTEX(eviction_tracker_policy_mutex);
 
+/* Indices of all mounted superblocks - protected by the policy mutex */
+static LIST_HEAD(eviction_tracker_indices);
+
 /* Our extension of dir_context to provide additional fields */
 struct eviction_tracker_iteration_context {
 	struct dir_context ctx;
 	bool recurse;
 	struct super_block *sb;
 	struct inode *parent;
-	struct eviction_tracker_scan_result *result;
+	struct eviction_tracker_batch *batch;
+	/* Index to fill while scanning, NULL if we don't rebuild an index */
+	struct eviction_tracker_index *index;
+	/* Candidates of a raw scan, NULL if we get every inode */
+	struct eviction_tracker_raw_batch *raw;
+};
+
+/*
+ * A file seen by a raw scan, with the attributes read from the inode store
+ * (see ouichefs_read_inode_attrs()), or copied from the in-core inode if it
+ * was cached.
+ */
+struct eviction_tracker_candidate {
+	struct eviction_candidate_attrs attrs;
+	unsigned long parent; /* Directory the file was found in */
+	char name[OUICHEFS_FILENAME_LEN];
+};
+
+/*
+ * Best candidates of a raw scan, sorted like the victims of a batch. The
+ * max_victims + 1 candidates are allocated once: a free one receives the
+ * attributes of the file being looked at and is only kept if it makes it into
+ * the victims.
+ */
+struct eviction_tracker_raw_batch {
+	struct eviction_tracker_candidate *candidates;
+	struct eviction_tracker_candidate *victims[EVICTION_TRACKER_BATCH_MAX];
+	struct eviction_tracker_candidate *free[EVICTION_TRACKER_BATCH_MAX + 1];
+	unsigned int nr_victims;
+	unsigned int nr_free;
+	unsigned long victims_blocks;
 };
 
+/*
+ * Entry of the eviction index. It only holds the score of the file, the inode
+ * doesn't need to stay in the inode cache.
+ */
+struct eviction_tracker_entry {
+	struct rb_node score_node; /* In index->root */
+	struct rb_node ino_node; /* In index->inodes */
+	u64 score;
+	unsigned long ino;
+	unsigned long parent; /* Directory the file was found in */
+	char name[OUICHEFS_FILENAME_LEN]; /* Name of the file in parent */
+};
+
+/*
+ * Names are kept padded with zeros like in directory blocks, so that they
+ * can be copied and compared with a fixed size.
+ */
+static void eviction_tracker_set_name(char *dst, const char *name, int len)
+{
+	len = strnlen(name, min(len, OUICHEFS_FILENAME_LEN));
+	memcpy(dst, name, len);
+	memset(dst + len, 0, OUICHEFS_FILENAME_LEN - len);
+}
+
+/* Attributes of inode given to the policy */
+static void eviction_tracker_inode_attrs(struct inode *inode,
+					 struct eviction_candidate_attrs *attrs)
+{
+	attrs->ino = inode->i_ino;
+	attrs->size = i_size_read(inode);
+	attrs->blocks = inode->i_blocks;
+	attrs->atime = inode->i_atime;
+	attrs->mtime = inode->i_mtime;
+	attrs->ctime = inode->i_ctime;
+	attrs->nlink = inode->i_nlink;
+	attrs->mode = inode->i_mode;
+}
+
+/* Score of inode given by policy */
+static u64 eviction_tracker_score(struct eviction_policy *policy,
+				  struct inode *inode)
+{
+	struct eviction_candidate_attrs attrs;
+
+	eviction_tracker_inode_attrs(inode, &attrs);
+	return policy->score(&attrs);
+}
+
+/* Only files and symlinks that are not in use can be evicted */
+static bool eviction_tracker_is_evictable(struct inode *inode)
+{
+	return (S_ISREG(inode->i_mode) || S_ISLNK(inode->i_mode)) &&
+	       atomic_read(&inode->i_readcount) == 0 &&
+	       atomic_read(&inode->i_writecount) == 0;
+}
+
+static bool eviction_tracker_index_usable(struct eviction_tracker_index *index)
+{
+	return index->state == EVICTION_INDEX_BUILDING ||
+	       index->state == EVICTION_INDEX_VALID;
+}
+
+/*
+ * Order of the index: highest score first, then lowest inode number. Returns
+ * a negative value if a file with score and ino comes before entry.
+ */
+static int eviction_tracker_entry_cmp(u64 score, unsigned long ino,
+				      struct eviction_tracker_entry *entry)
+{
+	if (score != entry->score)
+		return score > entry->score ? -1 : 1;
+	if (ino != entry->ino)
+		return ino < entry->ino ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Insert an entry into the index, sorted by score.
+ * index->lock must be held.
+ */
+static void
+__eviction_tracker_index_insert(struct eviction_tracker_index *index,
+				struct eviction_tracker_entry *entry)
+{
+	struct rb_node **link = &index->root.rb_root.rb_node;
+	struct rb_node *rb_parent = NULL;
+	bool leftmost = true;
+
+	while (*link) {
+		rb_parent = *link;
+		if (eviction_tracker_entry_cmp(
+			    entry->score, entry->ino,
+			    rb_entry(rb_parent, struct eviction_tracker_entry,
+				     score_node)) < 0) {
+			link = &rb_parent->rb_left;
+		} else {
+			link = &rb_parent->rb_right;
+			leftmost = false;
+		}
+	}
+
+	rb_link_node(&entry->score_node, rb_parent, link);
+	rb_insert_color_cached(&entry->score_node, &index->root, leftmost);
+}
+
+/*
+ * Remove an entry from the index, the caller frees it.
+ * index->lock must be held.
+ */
+static void
+__eviction_tracker_index_erase(struct eviction_tracker_index *index,
+			       struct eviction_tracker_entry *entry)
+{
+	rb_erase_cached(&entry->score_node, &index->root);
+	rb_erase(&entry->ino_node, &index->inodes);
+	index->nr_entries--;
+}
+
+/*
+ * Get the entry of inode ino, NULL if it isn't indexed.
+ * index->lock must be held.
+ */
+static struct eviction_tracker_entry *
+eviction_tracker_index_lookup(struct eviction_tracker_index *index,
+			      unsigned long ino)
+{
+	struct rb_node *node = index->inodes.rb_node;
+	struct eviction_tracker_entry *entry;
+
+	while (node) {
+		entry = rb_entry(node, struct eviction_tracker_entry, ino_node);
+		if (ino < entry->ino)
+			node = node->rb_left;
+		else if (ino > entry->ino)
+			node = node->rb_right;
+		else
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Add a file to the index with the score of its attributes. Hardlinks are only
+ * indexed once, for the first parent found. Returns false if entry wasn't
+ * used.
+ * index->lock must be held.
+ */
+static bool
+__eviction_tracker_index_add(struct eviction_tracker_index *index,
+			     struct eviction_tracker_entry *entry,
+			     const struct eviction_candidate_attrs *attrs,
+			     unsigned long parent, const char *name)
+{
+	struct rb_node **link = &index->inodes.rb_node;
+	struct rb_node *rb_parent = NULL;
+	struct eviction_tracker_entry *other;
+
+	if (!eviction_tracker_index_usable(index))
+		return false;
+
+	while (*link) {
+		rb_parent = *link;
+		other = rb_entry(rb_parent, struct eviction_tracker_entry,
+				 ino_node);
+		if (attrs->ino < other->ino)
+			link = &rb_parent->rb_left;
+		else if (attrs->ino > other->ino)
+			link = &rb_parent->rb_right;
+		else
+			return false;
+	}
+
+	entry->ino = attrs->ino;
+	entry->parent = parent;
+	memcpy(entry->name, name, OUICHEFS_FILENAME_LEN);
+	entry->score = index->policy->score(attrs);
+	rb_link_node(&entry->ino_node, rb_parent, link);
+	rb_insert_color(&entry->ino_node, &index->inodes);
+	__eviction_tracker_index_insert(index, entry);
+	index->nr_entries++;
+
+	return true;
+}
+
+static void
+eviction_tracker_index_add(struct eviction_tracker_index *index,
+			   const struct eviction_candidate_attrs *attrs,
+			   unsigned long parent, const char *name, int len)
+{
+	struct eviction_tracker_entry *entry;
+	char padded[OUICHEFS_FILENAME_LEN];
+	bool added;
+
+	/* Racy check to skip the allocation, done again under the lock */
+	if (!(S_ISREG(attrs->mode) || S_ISLNK(attrs->mode)) ||
+	    !eviction_tracker_index_usable(index))
+		return;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOFS);
+	eviction_tracker_set_name(padded, name, len);
+
+	spin_lock(&index->lock);
+	if (entry) {
+		added = __eviction_tracker_index_add(index, entry, attrs,
+						     parent, padded);
+	} else {
+		/* We lost track of the file */
+		added = false;
+		if (eviction_tracker_index_usable(index))
+			index->state = EVICTION_INDEX_INVALID;
+	}
+	spin_unlock(&index->lock);
+
+	if (!added)
+		kfree(entry);
+}
+
+/*
+ * Drop all entries of the index and leave it in the given state.
+ */
+static void
+eviction_tracker_index_clear(struct eviction_tracker_index *index,
+			     enum eviction_tracker_index_state state,
+			     struct eviction_policy *policy)
+{
+	struct eviction_tracker_entry *entry, *next;
+	struct rb_root root;
+
+	spin_lock(&index->lock);
+	root = index->root.rb_root;
+	index->root = RB_ROOT_CACHED;
+	index->inodes = RB_ROOT;
+	index->nr_entries = 0;
+	index->state = state;
+	WRITE_ONCE(index->policy, policy);
+	WRITE_ONCE(index->gen, index->gen + 1 ?: 1);
+	spin_unlock(&index->lock);
+
+	rbtree_postorder_for_each_entry_safe(entry, next, &root, score_node) {
+		kfree(entry);
+		cond_resched();
+	}
+}
+
+/* Drop the worst victim of the batch */
+static void
+eviction_tracker_batch_drop_last(struct eviction_tracker_batch *batch)
+{
+	struct eviction_tracker_scan_result *last =
+		&batch->victims[--batch->nr_victims];
+
+	batch->victims_blocks -= batch->blocks[batch->nr_victims];
+	iput(last->best_candidate);
+	iput(last->parent);
+}
+
+/* Compare the file with attributes attrs to a victim of the batch */
+static int
+eviction_tracker_compare(const struct eviction_candidate_attrs *attrs,
+			 struct inode *victim)
+{
+	struct eviction_candidate_attrs victim_attrs;
+
+	eviction_tracker_inode_attrs(victim, &victim_attrs);
+	return eviction_policy->compare(attrs, &victim_attrs);
+}
+
+/*
+ * Add a candidate to the batch if it's among the best ones. The batch is kept
+ * sorted (best candidate first) and only keeps the victims needed to free
+ * batch->nr_blocks blocks, so this is O(log k) compares for k victims.
+ */
+static void eviction_tracker_batch_add(struct eviction_tracker_batch *batch,
+				       struct inode *inode,
+				       struct inode *parent,
+				       const char *name, int len)
+{
+	struct eviction_candidate_attrs attrs;
+	unsigned int lo = 0, hi = batch->nr_victims;
+
+	eviction_tracker_inode_attrs(inode, &attrs);
+
+	/* The batch is full and inode is not better than the worst victim */
+	if (batch->nr_victims == batch->max_victims &&
+	    eviction_tracker_compare(
+		    &attrs, batch->victims[hi - 1].best_candidate) <= 0)
+		return;
+
+	/* Victims with the same priority are kept in scan order */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (eviction_tracker_compare(
+			    &attrs, batch->victims[mid].best_candidate) > 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	if (batch->nr_victims == batch->max_victims)
+		eviction_tracker_batch_drop_last(batch);
+
+	memmove(&batch->victims[lo + 1], &batch->victims[lo],
+		(batch->nr_victims - lo) * sizeof(batch->victims[0]));
+	memmove(&batch->blocks[lo + 1], &batch->blocks[lo],
+		(batch->nr_victims - lo) * sizeof(batch->blocks[0]));
+	ihold(inode);
+	ihold(parent);
+	batch->victims[lo].best_candidate = inode;
+	batch->victims[lo].parent = parent;
+	eviction_tracker_set_name(batch->victims[lo].name, name, len);
+	batch->blocks[lo] = inode->i_blocks;
+	batch->victims_blocks += inode->i_blocks;
+	batch->nr_victims++;
+
+	/* Drop the worst victims if the better ones free enough blocks */
+	while (batch->nr_victims > 1 &&
+	       batch->victims_blocks - batch->blocks[batch->nr_victims - 1] >=
+		       batch->nr_blocks)
+		eviction_tracker_batch_drop_last(batch);
+}
+
+void eviction_tracker_put_batch(struct eviction_tracker_batch *batch)
+{
+	while (batch->nr_victims)
+		eviction_tracker_batch_drop_last(batch);
+}
+
+/* Give the worst victim of a raw scan back to the free candidates */
+static void
+eviction_tracker_raw_batch_drop_last(struct eviction_tracker_raw_batch *raw)
+{
+	struct eviction_tracker_candidate *last =
+		raw->victims[--raw->nr_victims];
+
+	raw->victims_blocks -= last->attrs.blocks;
+	raw->free[raw->nr_free++] = last;
+}
+
+/*
+ * Same as eviction_tracker_batch_add() for the candidate on top of the free
+ * list of a raw scan.
+ */
+static void
+eviction_tracker_raw_batch_add(struct eviction_tracker_batch *batch,
+			       struct eviction_tracker_raw_batch *raw)
+{
+	struct eviction_tracker_candidate *cand = raw->free[raw->nr_free - 1];
+	struct eviction_tracker_candidate *last;
+	unsigned int lo = 0, hi = raw->nr_victims;
+
+	if (raw->nr_victims == batch->max_victims &&
+	    eviction_policy->compare(&cand->attrs,
+				     &raw->victims[hi - 1]->attrs) <= 0)
+		return;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (eviction_policy->compare(&cand->attrs,
+					     &raw->victims[mid]->attrs) > 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	raw->nr_free--;
+	if (raw->nr_victims == batch->max_victims)
+		eviction_tracker_raw_batch_drop_last(raw);
+
+	memmove(&raw->victims[lo + 1], &raw->victims[lo],
+		(raw->nr_victims - lo) * sizeof(raw->victims[0]));
+	raw->victims[lo] = cand;
+	raw->victims_blocks += cand->attrs.blocks;
+	raw->nr_victims++;
+
+	while (raw->nr_victims > 1) {
+		last = raw->victims[raw->nr_victims - 1];
+		if (raw->victims_blocks - last->attrs.blocks < batch->nr_blocks)
+			break;
+		eviction_tracker_raw_batch_drop_last(raw);
+	}
+}
+
+static void
+eviction_tracker_recurse(struct eviction_tracker_iteration_context *eti_ctx,
+			 struct inode *dir)
+{
+	/* Copy current context, just update parent and reset pos */
+	struct eviction_tracker_iteration_context new_eti_ctx;
+
+	memcpy(&new_eti_ctx, eti_ctx,
+	       sizeof(struct eviction_tracker_iteration_context));
+	new_eti_ctx.ctx.pos = 2;
+	new_eti_ctx.parent = dir;
+
+	/* Recurse into subdirectory */
+	ouichefs_iterate_inode(dir, &new_eti_ctx.ctx, true);
+}
+
+/*
+ * Look at file ino during a raw scan. If its inode is cached we use it, as it
+ * may be open or more recent than the inode store. Else the attributes are
+ * read from the inode store and the file is not added to the inode cache.
+ * Only directories we recurse into are got from the inode cache.
+ */
+static bool
+eviction_tracker_raw_visit(struct eviction_tracker_iteration_context *eti_ctx,
+			   const char *name, int namelen, u64 ino)
+{
+	struct eviction_tracker_raw_batch *raw = eti_ctx->raw;
+	struct eviction_tracker_candidate *cand = raw->free[raw->nr_free - 1];
+	struct super_block *sb = eti_ctx->sb;
+	struct inode *inode;
+	bool evictable;
+
+	inode = ilookup(sb, ino);
+	if (inode) {
+		evictable = eviction_tracker_is_evictable(inode);
+		eviction_tracker_inode_attrs(inode, &cand->attrs);
+	} else {
+		if (ouichefs_read_inode_attrs(sb, ino, &cand->attrs)) {
+			pr_err("inode not found\n");
+			return false;
+		}
+		/* Nobody can have it open, it isn't cached */
+		evictable = S_ISREG(cand->attrs.mode) ||
+			    S_ISLNK(cand->attrs.mode);
+		if (eti_ctx->recurse && S_ISDIR(cand->attrs.mode)) {
+			inode = ouichefs_iget(sb, ino);
+			if (IS_ERR(inode)) {
+				pr_err("inode not found\n");
+				return false;
+			}
+		}
+	}
+
+	if (eti_ctx->index)
+		eviction_tracker_index_add(eti_ctx->index, &cand->attrs,
+					   eti_ctx->parent->i_ino, name,
+					   namelen);
+
+	if (inode && eti_ctx->recurse && S_ISDIR(inode->i_mode)) {
+		eviction_tracker_recurse(eti_ctx, inode);
+	} else if (evictable) {
+		cand->parent = eti_ctx->parent->i_ino;
+		eviction_tracker_set_name(cand->name, name, namelen);
+		eviction_tracker_raw_batch_add(eti_ctx->batch, raw);
+	}
+
+	iput(inode);
+
+	return true;
+}
+
 static bool eviction_tracker_iteration_actor(struct dir_context *ctx,
 					     const char *name, int namelen,
 					     loff_t offset, u64 ino,
@@ -30,46 +527,31 @@ static bool eviction_tracker_iteration_actor(struct dir_context *ctx,
 	struct eviction_tracker_iteration_context *eti_ctx = container_of(
 		ctx, struct eviction_tracker_iteration_context, ctx);
 	struct super_block *sb = eti_ctx->sb;
+	struct eviction_candidate_attrs attrs;
+	struct inode *inode;
 
-	struct inode *inode = ouichefs_iget(sb, ino);
+	eti_ctx->batch->scanned++;
+	if (eti_ctx->raw)
+		return eviction_tracker_raw_visit(eti_ctx, name, namelen, ino);
 
-	if (inode == NULL) {
+	inode = ouichefs_iget(sb, ino);
+	if (IS_ERR(inode)) {
 		pr_err("inode not found\n");
 		return false;
 	}
 
-	if (eti_ctx->recurse && S_ISDIR(inode->i_mode)) {
-		/* Copy current context, just update parent and reset pos */
-		struct eviction_tracker_iteration_context new_eti_ctx;
-
-		memcpy(&new_eti_ctx, eti_ctx,
-		       sizeof(struct eviction_tracker_iteration_context));
-		new_eti_ctx.ctx.pos = 2;
-		new_eti_ctx.parent = inode;
-
-		/* Recurse into subdirectory */
-		ouichefs_iterate_inode(inode, &new_eti_ctx.ctx);
+	if (eti_ctx->index) {
+		eviction_tracker_inode_attrs(inode, &attrs);
+		eviction_tracker_index_add(eti_ctx->index, &attrs,
+					   eti_ctx->parent->i_ino, name,
+					   namelen);
 	}
 
-	else if ((S_ISREG(inode->i_mode) || S_ISLNK(inode->i_mode)) &&
-		 atomic_read(&inode->i_readcount) == 0 &&
-		 atomic_read(&inode->i_writecount) == 0) {
-		if (eti_ctx->result->best_candidate == NULL ||
-		    eviction_policy->compare(
-			    inode, eti_ctx->result->best_candidate) > 0) {
-			/*
-			 * We found a better (or the first) candidate
-			 * drop previous candidate (and parent) references
-			 * and hold an additional reference to new candidate
-			 * and parent (iput can handle NULL inodes)
-			 */
-			iput(eti_ctx->result->best_candidate);
-			iput(eti_ctx->result->parent);
-			ihold(inode);
-			ihold(eti_ctx->parent);
-			eti_ctx->result->best_candidate = inode;
-			eti_ctx->result->parent = eti_ctx->parent;
-		}
+	if (eti_ctx->recurse && S_ISDIR(inode->i_mode)) {
+		eviction_tracker_recurse(eti_ctx, inode);
+	} else if (eviction_tracker_is_evictable(inode)) {
+		eviction_tracker_batch_add(eti_ctx->batch, inode,
+					   eti_ctx->parent, name, namelen);
 	}
 
 	iput(inode);
@@ -79,49 +561,905 @@ static bool eviction_tracker_iteration_actor(struct dir_context *ctx,
 
 static void
 _get_best_file_for_deletion_new(struct inode *dir, bool recurse,
-				struct eviction_tracker_scan_result *result)
+				struct eviction_tracker_batch *batch,
+				struct eviction_tracker_index *index)
 {
 	struct eviction_tracker_iteration_context eti_ctx = {
 		/* Set pos = 2 to skip . and .. */
 		.ctx = { .actor = eviction_tracker_iteration_actor, .pos = 2 },
 		.recurse = recurse,
-		.result = result,
+		.batch = batch,
 		.sb = dir->i_sb,
 		.parent = dir,
+		.index = index,
+	};
+
+	ouichefs_iterate_inode(dir, &eti_ctx.ctx, recurse);
+}
+
+/*
+ * Same as _get_best_file_for_deletion_new(), but the files are compared using
+ * the attributes read from the inode store, and only the victims are got from
+ * the inode cache. Returns -ENOMEM if the candidates
+ * can't be allocated.
+ */
+static int eviction_tracker_raw_scan(struct inode *dir, bool recurse,
+				     struct eviction_tracker_batch *batch,
+				     struct eviction_tracker_index *index)
+{
+	struct super_block *sb = dir->i_sb;
+	struct eviction_tracker_raw_batch raw = {};
+	struct eviction_tracker_iteration_context eti_ctx = {
+		/* Set pos = 2 to skip . and .. */
+		.ctx = { .actor = eviction_tracker_iteration_actor, .pos = 2 },
+		.recurse = recurse,
+		.batch = batch,
+		.sb = sb,
+		.parent = dir,
+		.index = index,
+		.raw = &raw,
+	};
+	struct eviction_tracker_candidate *cand;
+	struct inode *inode, *parent;
+	unsigned int i;
+
+	raw.candidates = kcalloc(batch->max_victims + 1,
+				 sizeof(*raw.candidates), GFP_KERNEL);
+	if (!raw.candidates)
+		return -ENOMEM;
+	for (i = 0; i <= batch->max_victims; i++)
+		raw.free[raw.nr_free++] = &raw.candidates[i];
+
+	ouichefs_iterate_inode(dir, &eti_ctx.ctx, recurse);
+
+	for (i = 0; i < raw.nr_victims; i++) {
+		cand = raw.victims[i];
+		inode = ouichefs_iget(sb, cand->attrs.ino);
+		if (IS_ERR(inode))
+			continue;
+		parent = ouichefs_iget(sb, cand->parent);
+		if (IS_ERR(parent)) {
+			iput(inode);
+			continue;
+		}
+
+		/* It might have been opened since we looked at it */
+		if (!eviction_tracker_is_evictable(inode)) {
+			iput(parent);
+			iput(inode);
+			continue;
+		}
+
+		batch->victims[batch->nr_victims].best_candidate = inode;
+		batch->victims[batch->nr_victims].parent = parent;
+		memcpy(batch->victims[batch->nr_victims].name, cand->name,
+		       OUICHEFS_FILENAME_LEN);
+		batch->blocks[batch->nr_victims] = inode->i_blocks;
+		batch->victims_blocks += inode->i_blocks;
+		batch->nr_victims++;
+	}
+
+	kfree(raw.candidates);
+
+	return 0;
+}
+
+/* The victims of the batch free enough blocks, or there is no room left */
+static bool eviction_tracker_batch_done(struct eviction_tracker_batch *batch)
+{
+	return batch->nr_victims == batch->max_victims ||
+	       (batch->nr_victims && batch->victims_blocks >= batch->nr_blocks);
+}
+
+/*
+ * First node of the index after the file with score and ino, which might not
+ * be indexed anymore. index->lock must be held.
+ */
+static struct rb_node *
+eviction_tracker_index_next(struct eviction_tracker_index *index, u64 score,
+			    unsigned long ino)
+{
+	struct rb_node *node = index->root.rb_root.rb_node, *next = NULL;
+
+	while (node) {
+		if (eviction_tracker_entry_cmp(
+			    score, ino,
+			    rb_entry(node, struct eviction_tracker_entry,
+				     score_node)) < 0) {
+			next = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return next;
+}
+
+/*
+ * Check that the file of an entry is still in its parent directory under its
+ * name. A scan rebuilding the index can add a file that is unlinked before its
+ * entry is inserted, and the inode number might have been reused by another
+ * file since. Such stale entries are dropped. Returns true if the entry can be
+ * trusted.
+ */
+static bool eviction_tracker_index_check(struct eviction_tracker_index *index,
+					 struct inode *parent,
+					 const char *name, unsigned long ino)
+{
+	struct eviction_tracker_entry *entry;
+	struct qstr qname;
+	uint32_t found;
+	int ret;
+
+	qname.name = name;
+	qname.len = strnlen(name, OUICHEFS_FILENAME_LEN);
+	ret = ouichefs_dir_lookup(parent, &qname, &found);
+	if (!ret && found == ino)
+		return true;
+	if (ret && ret != -ENOENT) {
+		eviction_tracker_index_invalidate(parent->i_sb);
+		return false;
+	}
+
+	spin_lock(&index->lock);
+	entry = eviction_tracker_index_lookup(index, ino);
+	if (entry && entry->parent == parent->i_ino &&
+	    !memcmp(entry->name, name, OUICHEFS_FILENAME_LEN))
+		__eviction_tracker_index_erase(index, entry);
+	else
+		entry = NULL;
+	spin_unlock(&index->lock);
+
+	kfree(entry);
+	return false;
+}
+
+/*
+ * Get the best candidates from the index of the superblock, they are already
+ * sorted. The index doesn't pin the inodes, so they are got from the inode
+ * cache (or read from disk) a few entries at a time, without holding the
+ * index lock, and the ones in use are skipped.
+ * Returns 1 if candidates were found, 0 if the index contains no evictable
+ * file and -EAGAIN if the index can't be used and a scan is needed.
+ * Must be called with the policy mutex held.
+ */
+static int eviction_tracker_index_pick(struct super_block *sb,
+				       struct eviction_tracker_batch *batch)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct eviction_tracker_index *index = &sbi->eviction_index;
+	unsigned long inos[EVICTION_TRACKER_BATCH_MAX];
+	unsigned long parent_inos[EVICTION_TRACKER_BATCH_MAX];
+	char names[EVICTION_TRACKER_BATCH_MAX][OUICHEFS_FILENAME_LEN];
+	struct eviction_tracker_scan_result *victim;
+	struct eviction_tracker_entry *entry = NULL;
+	struct inode *inode, *parent;
+	struct rb_node *node;
+	u64 last_score = 0;
+	unsigned long last_ino = 0;
+	unsigned int i, nr;
+
+	do {
+		spin_lock(&index->lock);
+		if (index->state != EVICTION_INDEX_VALID ||
+		    index->policy != eviction_policy) {
+			spin_unlock(&index->lock);
+			return batch->nr_victims ? 1 : -EAGAIN;
+		}
+
+		/* Carry on after the last entry we looked at */
+		node = entry ? eviction_tracker_index_next(index, last_score,
+							   last_ino) :
+			       rb_first_cached(&index->root);
+		for (nr = 0; node && nr < EVICTION_TRACKER_BATCH_MAX;
+		     node = rb_next(node), nr++) {
+			entry = rb_entry(node, struct eviction_tracker_entry,
+					 score_node);
+			inos[nr] = entry->ino;
+			parent_inos[nr] = entry->parent;
+			memcpy(names[nr], entry->name, OUICHEFS_FILENAME_LEN);
+			last_score = entry->score;
+			last_ino = entry->ino;
+		}
+		spin_unlock(&index->lock);
+
+		for (i = 0; i < nr && !eviction_tracker_batch_done(batch);
+		     i++) {
+			batch->scanned++;
+			inode = ouichefs_iget(sb, inos[i]);
+			if (IS_ERR(inode)) {
+				pr_err("inode %lu not found\n", inos[i]);
+				eviction_tracker_index_invalidate(sb);
+				continue;
+			}
+			parent = ouichefs_iget(sb, parent_inos[i]);
+			if (IS_ERR(parent)) {
+				pr_err("parent %lu of inode %lu not found\n",
+				       parent_inos[i], inos[i]);
+				iput(inode);
+				eviction_tracker_index_invalidate(sb);
+				continue;
+			}
+
+			if (!eviction_tracker_index_check(index, parent,
+							  names[i], inos[i]) ||
+			    !eviction_tracker_is_evictable(inode) ||
+			    !inode->i_nlink) {
+				iput(parent);
+				iput(inode);
+				continue;
+			}
+
+			victim = &batch->victims[batch->nr_victims];
+			victim->best_candidate = inode;
+			victim->parent = parent;
+			memcpy(victim->name, names[i], OUICHEFS_FILENAME_LEN);
+			batch->blocks[batch->nr_victims] = inode->i_blocks;
+			batch->victims_blocks += inode->i_blocks;
+			batch->nr_victims++;
+		}
+	} while (nr && !eviction_tracker_batch_done(batch));
+
+	return batch->nr_victims ? 1 : 0;
+}
+
+/* Scan dir for the best candidates, raw or not, filling index if not NULL */
+static void eviction_tracker_scan(struct inode *dir, bool recurse,
+				  struct eviction_tracker_batch *batch,
+				  struct eviction_tracker_index *index,
+				  bool raw)
+{
+	if (!raw || eviction_tracker_raw_scan(dir, recurse, batch, index))
+		_get_best_file_for_deletion_new(dir, recurse, batch, index);
+}
+
+static struct eviction_tracker_victim_cache *
+eviction_tracker_get_cache(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct eviction_tracker_victim_cache *cache;
+
+	cache = READ_ONCE(ci->victim_cache);
+	if (cache)
+		return cache;
+
+	cache = kzalloc(sizeof(*cache), GFP_NOFS);
+	if (!cache)
+		return NULL;
+	spin_lock_init(&cache->lock);
+	if (cmpxchg(&ci->victim_cache, NULL, cache)) {
+		kfree(cache);
+		cache = READ_ONCE(ci->victim_cache);
+	}
+
+	return cache;
+}
+
+/*
+ * Fill the victim cache of dir with a scan keeping the best candidates. If a
+ * file left dir during the scan, the result isn't cached and the best
+ * candidate is directly put in batch instead. Returns true in that case.
+ */
+static bool
+eviction_tracker_cache_fill(struct inode *dir,
+			    struct eviction_tracker_victim_cache *cache,
+			    bool raw, struct eviction_tracker_batch *batch)
+{
+	struct eviction_tracker_batch scan = {
+		/* Keep all candidates, whatever their size */
+		.nr_blocks = ULONG_MAX,
+		.max_victims = EVICTION_TRACKER_CACHE_SIZE,
 	};
+	struct eviction_tracker_scan_result *victim;
+	unsigned int seq, i;
+	bool moved;
+
+	spin_lock(&cache->lock);
+	seq = cache->seq;
+	spin_unlock(&cache->lock);
+
+	eviction_tracker_scan(dir, false, &scan, NULL, raw);
+	batch->scanned += scan.scanned;
+
+	spin_lock(&cache->lock);
+	moved = cache->seq != seq;
+	if (!moved) {
+		cache->policy = eviction_policy;
+		cache->nr = scan.nr_victims;
+		for (i = 0; i < scan.nr_victims; i++) {
+			victim = &scan.victims[scan.nr_victims - 1 - i];
+			cache->victims[i].ino = victim->best_candidate->i_ino;
+			cache->victims[i].score =
+				eviction_policy->score ?
+					eviction_tracker_score(
+						eviction_policy,
+						victim->best_candidate) :
+					0;
+			memcpy(cache->victims[i].name, victim->name,
+			       OUICHEFS_FILENAME_LEN);
+		}
+	}
+	spin_unlock(&cache->lock);
+
+	if (moved && scan.nr_victims) {
+		/* Take over the references of the best candidate */
+		batch->victims[0] = scan.victims[0];
+		batch->blocks[0] = scan.blocks[0];
+		batch->victims_blocks = scan.blocks[0];
+		batch->nr_victims = 1;
+		scan.nr_victims--;
+		memmove(&scan.victims[0], &scan.victims[1],
+			scan.nr_victims * sizeof(scan.victims[0]));
+		memmove(&scan.blocks[0], &scan.blocks[1],
+			scan.nr_victims * sizeof(scan.blocks[0]));
+	}
+	eviction_tracker_put_batch(&scan);
+
+	return moved;
+}
+
+/*
+ * Evict a single file from dir without recursing (dir is full): take the best
+ * candidate from the victim cache of dir, which is filled by a scan when it is
+ * empty. Files created since the cache was filled are only considered once it
+ * is empty again. Cached files in use are skipped, and if the score of a cached
+ * file changed the order of the cache can't be trusted and it is filled again.
+ * Must be called with the policy mutex held.
+ */
+static void eviction_tracker_cache_pick(struct inode *dir, bool raw,
+					struct eviction_tracker_batch *batch)
+{
+	struct eviction_tracker_victim_cache *cache;
+	struct eviction_tracker_scan_result *victim = &batch->victims[0];
+	char name[OUICHEFS_FILENAME_LEN];
+	struct inode *inode;
+	unsigned long ino;
+	bool filled = false;
+	u64 score;
+
+	cache = eviction_tracker_get_cache(dir);
+	if (!cache) {
+		eviction_tracker_scan(dir, false, batch, NULL, raw);
+		return;
+	}
+
+	for (;;) {
+		spin_lock(&cache->lock);
+		if (cache->policy != eviction_policy)
+			cache->nr = 0;
+		if (!cache->nr) {
+			spin_unlock(&cache->lock);
+			if (filled)
+				return;
+			filled = true;
+			if (eviction_tracker_cache_fill(dir, cache, raw, batch))
+				return;
+			continue;
+		}
+		cache->nr--;
+		ino = cache->victims[cache->nr].ino;
+		score = cache->victims[cache->nr].score;
+		memcpy(name, cache->victims[cache->nr].name,
+		       OUICHEFS_FILENAME_LEN);
+		spin_unlock(&cache->lock);
+
+		batch->scanned++;
+		inode = ouichefs_iget(dir->i_sb, ino);
+		if (IS_ERR(inode))
+			continue;
+		if (!eviction_tracker_is_evictable(inode) || !inode->i_nlink) {
+			iput(inode);
+			continue;
+		}
+		if (!filled && eviction_policy->score &&
+		    eviction_tracker_score(eviction_policy, inode) != score) {
+			iput(inode);
+			spin_lock(&cache->lock);
+			cache->nr = 0;
+			spin_unlock(&cache->lock);
+			continue;
+		}
+		break;
+	}
 
-	ouichefs_iterate_inode(dir, &eti_ctx.ctx);
+	ihold(dir);
+	victim->best_candidate = inode;
+	victim->parent = dir;
+	memcpy(victim->name, name, OUICHEFS_FILENAME_LEN);
+	batch->blocks[0] = inode->i_blocks;
+	batch->victims_blocks = inode->i_blocks;
+	batch->nr_victims = 1;
+}
+
+void eviction_tracker_cache_forget(struct inode *dir, struct inode *inode)
+{
+	struct eviction_tracker_victim_cache *cache;
+	unsigned int i;
+
+	cache = READ_ONCE(OUICHEFS_INODE(dir)->victim_cache);
+	if (!cache)
+		return;
+
+	spin_lock(&cache->lock);
+	cache->seq++;
+	for (i = 0; i < cache->nr; i++) {
+		if (cache->victims[i].ino != inode->i_ino)
+			continue;
+		cache->nr--;
+		memmove(&cache->victims[i], &cache->victims[i + 1],
+			(cache->nr - i) * sizeof(cache->victims[0]));
+		break;
+	}
+	spin_unlock(&cache->lock);
+}
+
+bool eviction_tracker_get_inodes_for_eviction(
+	struct inode *dir, bool recurse, unsigned long nr_blocks,
+	unsigned int max_victims, struct eviction_tracker_batch *batch)
+{
+	bool raw = READ_ONCE(eviction_raw_scan);
+
+	batch->nr_blocks = nr_blocks;
+	batch->max_victims = clamp(max_victims, 1U, EVICTION_TRACKER_BATCH_MAX);
+	batch->nr_victims = 0;
+	batch->victims_blocks = 0;
+	batch->scanned = 0;
+
+	trace_ouichefs_eviction_scan_start(dir, recurse, nr_blocks,
+					   batch->max_victims);
+	mutex_lock(&eviction_tracker_policy_mutex);
+
+	/*
+	 * Recursive evictions from the root can use the index if the policy
+	 * scores files. If it can't be used, fall back to a full scan which
+	 * also rebuilds it.
+	 */
+	if (recurse && eviction_policy->score &&
+	    dir == d_inode(dir->i_sb->s_root)) {
+		struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+		struct eviction_tracker_index *index = &sbi->eviction_index;
+		int ret = eviction_tracker_index_pick(dir->i_sb, batch);
+
+		if (ret >= 0)
+			goto unlock;
+
+		eviction_tracker_index_clear(index, EVICTION_INDEX_BUILDING,
+					     eviction_policy);
+		eviction_tracker_scan(dir, recurse, batch, index, raw);
+
+		spin_lock(&index->lock);
+		if (index->state == EVICTION_INDEX_BUILDING)
+			index->state = EVICTION_INDEX_VALID;
+		spin_unlock(&index->lock);
+	} else if (!recurse && batch->max_victims == 1) {
+		eviction_tracker_cache_pick(dir, raw, batch);
+	} else {
+		eviction_tracker_scan(dir, recurse, batch, NULL, raw);
+	}
+
+unlock:
+	mutex_unlock(&eviction_tracker_policy_mutex);
+	trace_ouichefs_eviction_scan_end(dir, batch->nr_victims,
+					 batch->victims_blocks,
+					 batch->scanned);
+
+	if (batch->nr_victims == 0) {
+		pr_err("no file found for eviction\n");
+		return false;
+	}
+
+	return true;
 }
 
 bool eviction_tracker_get_inode_for_eviction(
 	struct inode *dir, bool recurse,
 	struct eviction_tracker_scan_result *result)
 {
+	struct eviction_tracker_batch batch;
+
 	result->best_candidate = NULL;
 	result->parent = NULL;
 
-	mutex_lock(&eviction_tracker_policy_mutex);
-
-	_get_best_file_for_deletion_new(dir, recurse, result);
-	if (result->best_candidate == NULL) {
-		pr_err("no file found for eviction\n");
-		mutex_unlock(&eviction_tracker_policy_mutex);
+	if (!eviction_tracker_get_inodes_for_eviction(dir, recurse, 0, 1,
+						      &batch))
 		return false;
+
+	/* Take over the references of the only victim */
+	*result = batch.victims[0];
+	return true;
+}
+
+static void eviction_tracker_stats_hist(atomic_long_t *hist,
+					unsigned long value)
+{
+	atomic_long_inc(&hist[min_t(unsigned int, fls_long(value),
+				    EVICTION_STATS_BUCKETS - 1)]);
+}
+
+int eviction_tracker_evict(struct inode *dir, bool recurse, bool lock_parent,
+			   unsigned long nr_blocks,
+			   enum eviction_tracker_trigger trigger,
+			   const char *reason)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	struct eviction_tracker_stats *stats = &sbi->eviction_stats;
+	struct eviction_tracker_batch batch;
+	bool done[EVICTION_TRACKER_BATCH_MAX] = { false };
+	unsigned int i, j, nr_evicted = 0;
+	unsigned long blocks, evicted_blocks = 0;
+	ktime_t start;
+	bool found;
+	int ret = 0;
+
+	mutex_lock(&sbi->eviction_mutex);
+
+	start = ktime_get();
+	found = eviction_tracker_get_inodes_for_eviction(
+		dir, recurse, nr_blocks,
+		nr_blocks ? EVICTION_TRACKER_BATCH_MAX : 1, &batch);
+	eviction_tracker_stats_hist(stats->latency_hist,
+				    ktime_us_delta(ktime_get(), start));
+	eviction_tracker_stats_hist(stats->scanned_hist, batch.scanned);
+	atomic_long_add(batch.scanned, &stats->scanned);
+	if (!found) {
+		mutex_unlock(&sbi->eviction_mutex);
+		return -ENOENT;
 	}
 
-	mutex_unlock(&eviction_tracker_policy_mutex);
+	/* Unlink the victims grouped by parent, one directory update each */
+	for (i = 0; i < batch.nr_victims; i++) {
+		struct inode *parent = batch.victims[i].parent;
+		struct inode *inodes[EVICTION_TRACKER_BATCH_MAX];
+		const char *names[EVICTION_TRACKER_BATCH_MAX];
+		int nr = 0, err;
 
-	return true;
+		blocks = 0;
+		if (done[i])
+			continue;
+
+		/*
+		 * The caller might hold the lock of some directory (e.g. the
+		 * one a file is created in), so we can only try to get the
+		 * parent lock
+		 */
+		if (lock_parent && !inode_trylock(parent)) {
+			ret = -EAGAIN;
+			continue;
+		}
+
+		for (j = i; j < batch.nr_victims; j++) {
+			struct inode *inode = batch.victims[j].best_candidate;
+
+			if (done[j] || batch.victims[j].parent != parent)
+				continue;
+			done[j] = true;
+
+			/* Someone else unlinked it in the meantime */
+			if (inode->i_nlink == 0)
+				continue;
+
+			pr_info("%s - evicting inode %ld\n", reason,
+				inode->i_ino);
+			/* The blocks of hardlinked files are not freed */
+			if (inode->i_nlink == 1)
+				blocks += inode->i_blocks;
+			names[nr] = batch.victims[j].name;
+			inodes[nr++] = inode;
+		}
+
+		err = ouichefs_unlink_inodes(parent, inodes, names, nr);
+		if (err < 0) {
+			pr_err("unlink of %d inodes in directory %ld failed\n",
+			       nr, parent->i_ino);
+			ret = err;
+		} else {
+			/*
+			 * Hacky bugfix: we use inodes to unlink files instead
+			 * of dentries so we need to prune leftover aliases in
+			 * the dcache after unlinking the inode.
+			 * If we used vfs_unlink() instead of
+			 * ouichefs_unlink_inode() we probably wouldn't need to
+			 * do this
+			 * If we don't do this, something like this will fail:
+			 * $ touch file1
+			 * (trigger eviction of file1)
+			 * $ touch file1
+			 * --> file1 won't be created again because it's still
+			 * in the dcache
+			 *
+			 * This will probably also remove hardlink aliases from
+			 * dcache and thus could hurt performance a little bit
+			 * when using hardlinks
+			 */
+			for (j = 0; j < nr; j++)
+				d_prune_aliases(inodes[j]);
+			nr_evicted += nr;
+			evicted_blocks += blocks;
+		}
+
+		if (lock_parent)
+			inode_unlock(parent);
+	}
+
+	eviction_tracker_put_batch(&batch);
+	mutex_unlock(&sbi->eviction_mutex);
+
+	if (nr_evicted) {
+		atomic_long_inc(&stats->evictions[trigger]);
+		atomic_long_add(nr_evicted, &stats->files);
+		atomic_long_add(evicted_blocks, &stats->blocks);
+	}
+
+	/* Candidates unlinked concurrently count as success */
+	return nr_evicted || !ret ? 0 : ret;
+}
+
+/*
+ * Background eviction: evict files until the high watermark is reached.
+ * Unlike synchronous evictions the worker holds no directory lock, so it
+ * locks the parent directory of each victim. Nothing is evicted while the
+ * filesystem is frozen, the next allocation below the low watermark wakes us
+ * up again once it is thawed.
+ */
+static void eviction_tracker_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, eviction_work);
+	struct inode *root = d_inode(sbi->sb->s_root);
+	int high = max(eviction_low_watermark, eviction_high_watermark);
+	int retries = 0;
+
+	while (!READ_ONCE(sbi->eviction_stopped) &&
+	       ouichefs_free_blocks_percentage(sbi) < high) {
+		int ret;
+
+		if (!sb_start_write_trylock(sbi->sb))
+			break;
+		ret = eviction_tracker_evict(
+			root, true, true, ouichefs_blocks_to_reach(sbi, high),
+			EVICTION_TRIGGER_BACKGROUND, "below low watermark");
+		sb_end_write(sbi->sb);
+
+		if (ret == -EAGAIN) {
+			/* Parent directory busy, give its owner some time */
+			if (++retries > EVICTION_WORKER_MAX_RETRIES)
+				break;
+			usleep_range(100, 1000);
+			continue;
+		}
+		if (ret < 0)
+			break;
+
+		retries = 0;
+		cond_resched();
+	}
+}
+
+void eviction_tracker_worker_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	sbi->eviction_stopped = false;
+	INIT_WORK(&sbi->eviction_work, eviction_tracker_work);
+}
+
+void eviction_tracker_wake_worker(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (READ_ONCE(sbi->eviction_stopped))
+		return;
+
+	/* Does nothing if the work is already pending */
+	queue_work(system_unbound_wq, &sbi->eviction_work);
+}
+
+void eviction_tracker_worker_stop(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	WRITE_ONCE(sbi->eviction_stopped, true);
+	cancel_work_sync(&sbi->eviction_work);
 }
 
 int eviction_tracker_change_policy(struct eviction_policy *new_eviction_policy)
 {
+	struct eviction_tracker_index *index;
+
 	mutex_lock(&eviction_tracker_policy_mutex);
 
 	eviction_policy = new_eviction_policy ? new_eviction_policy :
 						default_eviction_policy;
 
+	/*
+	 * The indices are sorted by the old policy (which might be about to be
+	 * unloaded), invalidate them so it is never called again. Wait for
+	 * eviction_tracker_index_update() calls that got it without the index
+	 * lock.
+	 */
+	list_for_each_entry(index, &eviction_tracker_indices, list) {
+		spin_lock(&index->lock);
+		if (index->state != EVICTION_INDEX_EMPTY)
+			index->state = EVICTION_INDEX_INVALID;
+		WRITE_ONCE(index->policy, NULL);
+		spin_unlock(&index->lock);
+	}
+	synchronize_rcu();
+
 	mutex_unlock(&eviction_tracker_policy_mutex);
 	return 0;
 }
 EXPORT_SYMBOL(eviction_tracker_change_policy);
+
+void eviction_tracker_index_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct eviction_tracker_index *index = &sbi->eviction_index;
+
+	/* The index is populated by the first recursive eviction */
+	spin_lock_init(&index->lock);
+	index->root = RB_ROOT_CACHED;
+	index->inodes = RB_ROOT;
+	index->policy = NULL;
+	index->state = EVICTION_INDEX_EMPTY;
+	index->gen = 1;
+	index->nr_entries = 0;
+
+	mutex_lock(&eviction_tracker_policy_mutex);
+	list_add(&index->list, &eviction_tracker_indices);
+	mutex_unlock(&eviction_tracker_policy_mutex);
+}
+
+void eviction_tracker_index_destroy(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct eviction_tracker_index *index = &sbi->eviction_index;
+
+	mutex_lock(&eviction_tracker_policy_mutex);
+	list_del(&index->list);
+	mutex_unlock(&eviction_tracker_policy_mutex);
+
+	eviction_tracker_index_clear(index, EVICTION_INDEX_EMPTY, NULL);
+}
+
+void eviction_tracker_index_insert(struct inode *inode, struct inode *parent,
+				   const struct qstr *name)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+
+	struct eviction_candidate_attrs attrs;
+
+	eviction_tracker_inode_attrs(inode, &attrs);
+	eviction_tracker_index_add(&sbi->eviction_index, &attrs, parent->i_ino,
+				   name->name, name->len);
+}
+
+void eviction_tracker_index_unlink(struct inode *inode, struct inode *dir)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct eviction_tracker_index *index = &sbi->eviction_index;
+	struct eviction_tracker_entry *entry;
+
+	spin_lock(&index->lock);
+	entry = eviction_tracker_index_lookup(index, inode->i_ino);
+	if (entry && inode->i_nlink > 1) {
+		/*
+		 * Another link survives but we only know the parent of the
+		 * indexed one - if it's this one we lost track of the file
+		 */
+		if (entry->parent == dir->i_ino)
+			index->state = EVICTION_INDEX_INVALID;
+		entry = NULL;
+	} else if (entry) {
+		__eviction_tracker_index_erase(index, entry);
+	}
+	spin_unlock(&index->lock);
+
+	kfree(entry);
+}
+
+void eviction_tracker_index_forget(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct eviction_tracker_index *index = &sbi->eviction_index;
+	struct eviction_tracker_entry *entry;
+
+	spin_lock(&index->lock);
+	entry = eviction_tracker_index_lookup(index, inode->i_ino);
+	if (entry)
+		__eviction_tracker_index_erase(index, entry);
+	spin_unlock(&index->lock);
+
+	kfree(entry);
+}
+
+void eviction_tracker_index_update(struct inode *inode, unsigned int events)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct eviction_tracker_index *index = &sbi->eviction_index;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct eviction_tracker_entry *entry;
+	struct eviction_policy *policy;
+	u64 score;
+
+	/* Fast path for inodes that are not indexed (e.g. directories) */
+	if (!S_ISREG(inode->i_mode) && !S_ISLNK(inode->i_mode))
+		return;
+
+	/*
+	 * Most updates (e.g. of atime) don't change the score. Compare it to
+	 * the score we gave the entry last time without taking the index lock,
+	 * which every writer would contend on. The policy can't be unloaded
+	 * before the RCU grace period ends (eviction_tracker_change_policy()).
+	 */
+	rcu_read_lock();
+	policy = READ_ONCE(index->policy);
+	if (!policy || !(policy->events & events)) {
+		rcu_read_unlock();
+		return;
+	}
+	score = eviction_tracker_score(policy, inode);
+	rcu_read_unlock();
+	if (READ_ONCE(ci->eviction_gen) == READ_ONCE(index->gen) &&
+	    READ_ONCE(ci->eviction_score) == score)
+		return;
+
+	spin_lock(&index->lock);
+	if (!eviction_tracker_index_usable(index) ||
+	    !(index->policy->events & events))
+		goto unlock;
+
+	entry = eviction_tracker_index_lookup(index, inode->i_ino);
+	if (!entry)
+		goto unlock;
+
+	/* Only move the entry if the score changed */
+	score = eviction_tracker_score(index->policy, inode);
+	if (score != entry->score) {
+		rb_erase_cached(&entry->score_node, &index->root);
+		entry->score = score;
+		__eviction_tracker_index_insert(index, entry);
+	}
+	WRITE_ONCE(ci->eviction_score, score);
+	WRITE_ONCE(ci->eviction_gen, index->gen);
+
+unlock:
+	spin_unlock(&index->lock);
+}
+
+void eviction_tracker_index_move(struct inode *inode, struct inode *old_dir,
+				 struct inode *new_dir,
+				 const struct qstr *new_name)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct eviction_tracker_index *index = &sbi->eviction_index;
+	struct eviction_tracker_entry *entry;
+	char name[OUICHEFS_FILENAME_LEN];
+
+	eviction_tracker_set_name(name, new_name->name, new_name->len);
+
+	/*
+	 * If another link of the file is indexed the entry is left alone. Its
+	 * name is only a hint, a stale one makes eviction look for the file in
+	 * the whole directory.
+	 */
+	spin_lock(&index->lock);
+	entry = eviction_tracker_index_lookup(index, inode->i_ino);
+	if (entry && entry->parent == old_dir->i_ino) {
+		entry->parent = new_dir->i_ino;
+		memcpy(entry->name, name, OUICHEFS_FILENAME_LEN);
+	}
+	spin_unlock(&index->lock);
+}
+
+void eviction_tracker_index_invalidate(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct eviction_tracker_index *index = &sbi->eviction_index;
+
+	spin_lock(&index->lock);
+	if (index->state != EVICTION_INDEX_EMPTY)
+		index->state = EVICTION_INDEX_INVALID;
+	spin_unlock(&index->lock);
+}
@@ -1,8 +1,14 @@
 #ifndef _EVICTION_TRACKER_H
 #define _EVICTION_TRACKER_H
 
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+
 #include "eviction_policy.h"
 
+/* Compare candidates using the inode store instead of getting their inodes */
+extern bool eviction_raw_scan;
+
 /**
  * @brief Change the eviction policy used to compare inodes regarding their eviction priority
  * @param new_eviction_policy The new eviction policy to use, or NULL to reset to the default policy
@@ -13,6 +19,8 @@ int eviction_tracker_change_policy(struct eviction_policy *eviction_policy);
 struct eviction_tracker_scan_result {
 	struct inode *best_candidate;
 	struct inode *parent;
+	/* Name in parent padded like in a directory, empty if not known */
+	char name[OUICHEFS_FILENAME_LEN];
 };
 
 /**
@@ -25,4 +33,216 @@ struct eviction_tracker_scan_result {
 bool eviction_tracker_get_inode_for_eviction(
 	struct inode *dir, bool recurse,
 	struct eviction_tracker_scan_result *result);
+
+/* Maximum number of files evicted at once */
+#define EVICTION_TRACKER_BATCH_MAX 16U
+
+struct eviction_tracker_batch {
+	unsigned long nr_blocks; /* Number of blocks we want to free */
+	unsigned int max_victims;
+	unsigned int nr_victims;
+	unsigned long victims_blocks; /* Sum of i_blocks of all victims */
+	/* Best candidate first, each one holds inode and parent references */
+	struct eviction_tracker_scan_result victims[EVICTION_TRACKER_BATCH_MAX];
+	/* i_blocks of each victim when it was added */
+	blkcnt_t blocks[EVICTION_TRACKER_BATCH_MAX];
+	unsigned long scanned; /* Number of files looked at */
+};
+
+/**
+ * @brief Like eviction_tracker_get_inode_for_eviction but find the best candidates that together free nr_blocks blocks in a single traversal
+ * @param dir Start directory
+ * @param recurse Flag to indicate if we should recurse into subdirectories
+ * @param nr_blocks Number of blocks the victims should free (sum of i_blocks) - the best candidate is always returned
+ * @param max_victims Maximum number of victims (at most EVICTION_TRACKER_BATCH_MAX)
+ * @param batch Result parameter that will contain the victims sorted by priority, must be released with eviction_tracker_put_batch
+ * @return true if at least one candidate was found, false if no candidate was found
+ */
+bool eviction_tracker_get_inodes_for_eviction(
+	struct inode *dir, bool recurse, unsigned long nr_blocks,
+	unsigned int max_victims, struct eviction_tracker_batch *batch);
+
+/**
+ * @brief Drop the references held by a batch
+ * @param batch The batch
+ */
+void eviction_tracker_put_batch(struct eviction_tracker_batch *batch);
+
+/* What triggered an eviction, for the statistics */
+enum eviction_tracker_trigger {
+	/* An allocation found less than eviction_percentage_threshold free */
+	EVICTION_TRIGGER_SPACE,
+	/* The worker runs below the low watermark */
+	EVICTION_TRIGGER_BACKGROUND,
+	/* A file is added to a full directory */
+	EVICTION_TRIGGER_DIR_FULL,
+	/* Written to /sys/kernel/ouichefs/evict or evict_recursive */
+	EVICTION_TRIGGER_MANUAL,
+	EVICTION_TRIGGER_MAX,
+};
+
+/* Histograms have one bucket per power of 2, the last one is unbounded */
+#define EVICTION_STATS_BUCKETS 32
+
+/* Eviction statistics of a partition, in /sys/kernel/ouichefs/<device>/ */
+struct eviction_tracker_stats {
+	/* Evictions that evicted at least one file, by trigger */
+	atomic_long_t evictions[EVICTION_TRIGGER_MAX];
+	atomic_long_t files; /* Files evicted */
+	atomic_long_t blocks; /* Blocks of the evicted files */
+	atomic_long_t scanned; /* Files looked at to find candidates */
+	/* Files looked at per eviction, bucket b counts values below 2^b */
+	atomic_long_t scanned_hist[EVICTION_STATS_BUCKETS];
+	/* Time to find the candidates in us, bucketed like scanned_hist */
+	atomic_long_t latency_hist[EVICTION_STATS_BUCKETS];
+};
+
+/**
+ * @brief Find the best candidates for eviction below dir and unlink them from their parents. Evictions of a superblock are serialized
+ * @param dir Start directory
+ * @param recurse Flag to indicate if we should recurse into subdirectories (see eviction_tracker_get_inode_for_eviction)
+ * @param lock_parent Flag to indicate if the parent directories of the candidates must be locked - only possible if the caller holds no directory lock
+ * @param nr_blocks Number of blocks to free, or 0 to evict exactly one file
+ * @param trigger What triggered the eviction, used for the statistics
+ * @param reason Reason for the eviction, used for logging
+ * @return 0 if files were evicted (or were unlinked concurrently), -ENOENT if no candidate was found, -EAGAIN if no parent could be locked or another negative error code
+ */
+int eviction_tracker_evict(struct inode *dir, bool recurse, bool lock_parent,
+			   unsigned long nr_blocks,
+			   enum eviction_tracker_trigger trigger,
+			   const char *reason);
+
+/**
+ * @brief Initialize the background eviction worker of a superblock
+ * @param sb The superblock
+ */
+void eviction_tracker_worker_init(struct super_block *sb);
+
+/**
+ * @brief Start background eviction (if free space is below the low watermark)
+ * @param sb The superblock
+ */
+void eviction_tracker_wake_worker(struct super_block *sb);
+
+/**
+ * @brief Stop the background eviction worker and wait for it - must be called before the superblock is shut down
+ * @param sb The superblock
+ */
+void eviction_tracker_worker_stop(struct super_block *sb);
+
+enum eviction_tracker_index_state {
+	/* Not built yet, the next recursive eviction from the root builds it */
+	EVICTION_INDEX_EMPTY,
+	/* A scan is currently filling the index */
+	EVICTION_INDEX_BUILDING,
+	/* The index contains every evictable file of the filesystem */
+	EVICTION_INDEX_VALID,
+	/* The policy changed or we lost track of a file, rebuild needed */
+	EVICTION_INDEX_INVALID,
+};
+
+/*
+ * Per-superblock index of all regular files and symlinks, sorted by the score
+ * given by the eviction policy that was active when the index was built
+ * (leftmost node is the best candidate). Only policies with a score use it.
+ * Entries only hold the score, the inode number and the parent of a file, so
+ * indexed inodes don't stay in the inode cache.
+ */
+struct eviction_tracker_index {
+	spinlock_t lock; /* Protects everything below */
+	struct rb_root_cached root; /* Entries by score */
+	struct rb_root inodes; /* Entries by inode number */
+	/* Policy used to sort root, NULL once it is replaced (RCU) */
+	struct eviction_policy *policy;
+	enum eviction_tracker_index_state state;
+	unsigned int gen; /* Bumped when the index is cleared, never 0 */
+	unsigned long nr_entries;
+	struct list_head list; /* Entry in the global list of indices */
+};
+
+/* Number of candidates kept by the victim cache of a directory */
+#define EVICTION_TRACKER_CACHE_SIZE 8
+
+/*
+ * Best candidates of a directory for non-recursive evictions (i.e. when the
+ * directory is full), so that consecutive evictions in a full directory don't
+ * scan it every time. Allocated by the first such eviction.
+ */
+struct eviction_tracker_victim_cache {
+	spinlock_t lock; /* Protects everything below */
+	struct eviction_policy *policy; /* Policy used to fill the cache */
+	unsigned int seq; /* Bumped when a file leaves the directory */
+	unsigned int nr;
+	/* Best candidate last, with its score if the policy has one */
+	struct {
+		unsigned long ino;
+		u64 score;
+		char name[OUICHEFS_FILENAME_LEN];
+	} victims[EVICTION_TRACKER_CACHE_SIZE];
+};
+
+/**
+ * @brief Remove a file leaving a directory from the victim cache of the directory
+ * @param dir The directory
+ * @param inode The file
+ */
+void eviction_tracker_cache_forget(struct inode *dir, struct inode *inode);
+
+/**
+ * @brief Initialize the (empty) eviction index of a freshly mounted superblock
+ * @param sb The superblock
+ */
+void eviction_tracker_index_init(struct super_block *sb);
+
+/**
+ * @brief Drop all entries of the eviction index - must be called before the superblock is shut down
+ * @param sb The superblock
+ */
+void eviction_tracker_index_destroy(struct super_block *sb);
+
+/**
+ * @brief Add a newly created file to the eviction index
+ * @param inode The new file
+ * @param parent The directory the file was created in
+ * @param name The name of the file in parent
+ */
+void eviction_tracker_index_insert(struct inode *inode, struct inode *parent,
+				   const struct qstr *name);
+
+/**
+ * @brief Tell the eviction index that a link of a file is being removed
+ * @param inode The file
+ * @param dir The directory the link is removed from
+ */
+void eviction_tracker_index_unlink(struct inode *inode, struct inode *dir);
+
+/**
+ * @brief Drop the entry of a file without links from the eviction index, if it has one
+ * @param inode The file
+ */
+void eviction_tracker_index_forget(struct inode *inode);
+
+/**
+ * @brief Score a file again and re-sort it in the eviction index if the policy of the index declared one of the events
+ * @param inode The file
+ * @param events The EVICTION_EVENT_* that happened to the file
+ */
+void eviction_tracker_index_update(struct inode *inode, unsigned int events);
+
+/**
+ * @brief Record that a file was renamed, possibly to another directory
+ * @param inode The file
+ * @param old_dir The directory the file was moved from
+ * @param new_dir The directory the file was moved to (can be old_dir)
+ * @param new_name The new name of the file
+ */
+void eviction_tracker_index_move(struct inode *inode, struct inode *old_dir,
+				 struct inode *new_dir,
+				 const struct qstr *new_name);
+
+/**
+ * @brief Mark the eviction index as out of sync, forcing a rebuild on the next recursive eviction
+ * @param sb The superblock
+ */
+void eviction_tracker_index_invalidate(struct super_block *sb);
 #endif
@@ -0,0 +1,480 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+
+#include "ouichefs.h"
+#include "extent.h"
+#include "inode.h"
+#include "bitmap.h"
+
+/*
+ * Initialize the index block of a new file as an empty extent tree.
+ */
+void ouichefs_extent_init_root(struct ouichefs_extent_block *root)
+{
+	memset(root, 0, sizeof(*root));
+	root->header.magic = OUICHEFS_EXTENT_MAGIC;
+}
+
+/*
+ * Check that an extent block read from disk can be used. Only the root can
+ * hold index entries.
+ */
+static bool ouichefs_extent_block_ok(struct ouichefs_extent_block *eb,
+				     bool is_root)
+{
+	struct ouichefs_extent_header *h = &eb->header;
+
+	if (h->magic != OUICHEFS_EXTENT_MAGIC)
+		return false;
+	if (h->depth == 0)
+		return h->nr_entries <= OUICHEFS_EXTENTS_PER_BLOCK;
+	return is_root && h->depth == 1 && h->nr_entries > 0 &&
+	       h->nr_entries <= OUICHEFS_EXTENT_IDX_PER_BLOCK;
+}
+
+/* Position of the last extent starting at or before iblock, -1 if none */
+static int ouichefs_extent_search(struct ouichefs_extent_block *leaf,
+				  uint32_t iblock)
+{
+	int lo = 0, hi = leaf->header.nr_entries - 1, pos = -1;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (leaf->extents[mid].ee_block <= iblock) {
+			pos = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return pos;
+}
+
+/* Position of the leaf covering iblock in a root of depth 1 */
+static int ouichefs_extent_idx_search(struct ouichefs_extent_block *root,
+				      uint32_t iblock)
+{
+	int lo = 0, hi = root->header.nr_entries - 1, pos = 0;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (root->idx[mid].ei_block <= iblock) {
+			pos = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return pos;
+}
+
+/*
+ * Make room for a new extent covering iblock when its leaf (bh_leaf, which is
+ * bh_root for a tree of depth 0) is full:
+ *   - a full root of depth 0 moves its extents to a new leaf and becomes an
+ *     index of depth 1
+ *   - a full leaf gets a new empty sibling when we append past its last
+ *     extent (sequential writes keep their leaves full), else it is split in
+ *     two halves
+ * The caller must look iblock up again afterwards. If iblock ends up in a new
+ * empty leaf, *goal is set to the block following the last extent of the full
+ * one, so that appends stay contiguous across leaves.
+ */
+static int ouichefs_extent_grow(struct inode *inode,
+				struct buffer_head *bh_root, int slot,
+				struct buffer_head *bh_leaf, uint32_t iblock,
+				uint32_t *goal)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_extent_block *root, *leaf, *new_leaf;
+	struct ouichefs_extent *last;
+	struct buffer_head *bh_new;
+	uint32_t bno, first;
+	int nr, half;
+
+	root = (struct ouichefs_extent_block *)bh_root->b_data;
+	leaf = (struct ouichefs_extent_block *)bh_leaf->b_data;
+
+	if (root->header.depth &&
+	    root->header.nr_entries == OUICHEFS_EXTENT_IDX_PER_BLOCK)
+		return -EFBIG;
+
+	bno = get_free_block(sb);
+	if (!bno)
+		return -ENOSPC;
+	/* The block is overwritten, don't read it first */
+	bh_new = sb_getblk(sb, bno);
+	if (!bh_new) {
+		put_block(OUICHEFS_SB(sb), bno);
+		return -ENOMEM;
+	}
+	lock_buffer(bh_new);
+	memset(bh_new->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh_new);
+	unlock_buffer(bh_new);
+	new_leaf = (struct ouichefs_extent_block *)bh_new->b_data;
+
+	if (!root->header.depth) {
+		memcpy(new_leaf, root, sizeof(*root));
+		ouichefs_extent_init_root(root);
+		root->header.depth = 1;
+		root->header.nr_entries = 1;
+		root->idx[0].ei_block = 0;
+		root->idx[0].ei_leaf = bno;
+		goto dirty;
+	}
+
+	nr = leaf->header.nr_entries;
+	last = &leaf->extents[nr - 1];
+	ouichefs_extent_init_root(new_leaf);
+	if (slot == root->header.nr_entries - 1 &&
+	    iblock >= last->ee_block + last->ee_len) {
+		first = iblock;
+		*goal = last->ee_start + last->ee_len;
+	} else {
+		half = nr / 2;
+		memcpy(new_leaf->extents, &leaf->extents[half],
+		       (nr - half) * sizeof(struct ouichefs_extent));
+		new_leaf->header.nr_entries = nr - half;
+		memset(&leaf->extents[half], 0,
+		       (nr - half) * sizeof(struct ouichefs_extent));
+		leaf->header.nr_entries = half;
+		first = new_leaf->extents[0].ee_block;
+		mark_buffer_dirty_inode(bh_leaf, inode);
+	}
+
+	/* Insert the new leaf right after the full one */
+	slot++;
+	memmove(&root->idx[slot + 1], &root->idx[slot],
+		(root->header.nr_entries - slot) *
+			sizeof(struct ouichefs_extent_idx));
+	root->idx[slot].ei_block = first;
+	root->idx[slot].ei_leaf = bno;
+	root->header.nr_entries++;
+
+dirty:
+	mark_buffer_dirty_inode(bh_new, inode);
+	brelse(bh_new);
+	mark_buffer_dirty_inode(bh_root, inode);
+
+	inode->i_blocks++;
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+/*
+ * Map up to max_blocks blocks of inode starting at iblock. On success, *bno is
+ * the physical block of iblock and *len the number of physically contiguous
+ * blocks that follow. If iblock is not allocated, *bno is 0 and *len the size
+ * of the hole, unless create is true: the blocks are then allocated (as many
+ * contiguous blocks as possible, right after the previous extent if we can)
+ * and *new is set.
+ */
+int ouichefs_extent_map(struct inode *inode, uint32_t iblock,
+			uint32_t max_blocks, bool create, uint32_t *bno,
+			uint32_t *len, bool *new)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh_root, *bh_leaf = NULL;
+	struct ouichefs_extent_block *root, *leaf;
+	struct ouichefs_extent *ext, *next_ext;
+	uint32_t next, goal, hole, grow_goal = 0;
+	int slot = 0, pos, ret = 0;
+
+	*new = false;
+
+	mutex_lock(&ci->map_mutex);
+	bh_root = ouichefs_index_bh(inode);
+	if (!bh_root) {
+		ret = -EIO;
+		goto unlock;
+	}
+	root = (struct ouichefs_extent_block *)bh_root->b_data;
+	if (!ouichefs_extent_block_ok(root, true)) {
+		pr_err("corrupted extent tree in inode %lu\n", inode->i_ino);
+		ret = -EUCLEAN;
+		goto brelse_root;
+	}
+
+again:
+	/* Find the leaf covering iblock and where the next leaf starts */
+	next = U32_MAX;
+	leaf = root;
+	if (root->header.depth) {
+		slot = ouichefs_extent_idx_search(root, iblock);
+		if (slot + 1 < root->header.nr_entries)
+			next = root->idx[slot + 1].ei_block;
+		bh_leaf = sb_bread(sb, root->idx[slot].ei_leaf);
+		if (!bh_leaf) {
+			ret = -EIO;
+			goto brelse_root;
+		}
+		leaf = (struct ouichefs_extent_block *)bh_leaf->b_data;
+		if (!ouichefs_extent_block_ok(leaf, false)) {
+			pr_err("corrupted extent leaf in inode %lu\n",
+			       inode->i_ino);
+			ret = -EUCLEAN;
+			goto brelse_leaf;
+		}
+	}
+
+	/* Is iblock inside an extent? */
+	ext = NULL;
+	goal = grow_goal;
+	pos = ouichefs_extent_search(leaf, iblock);
+	if (pos >= 0) {
+		ext = &leaf->extents[pos];
+		if (iblock - ext->ee_block < ext->ee_len) {
+			*bno = ext->ee_start + (iblock - ext->ee_block);
+			*len = min(max_blocks,
+				   ext->ee_len - (iblock - ext->ee_block));
+			goto brelse_leaf;
+		}
+		goal = ext->ee_start + ext->ee_len;
+	}
+	if (pos + 1 < leaf->header.nr_entries)
+		next = leaf->extents[pos + 1].ee_block;
+	hole = min(max_blocks, next - iblock);
+
+	if (!create) {
+		*bno = 0;
+		*len = hole;
+		goto brelse_leaf;
+	}
+
+	if (leaf->header.nr_entries == OUICHEFS_EXTENTS_PER_BLOCK) {
+		ret = ouichefs_extent_grow(inode, bh_root, slot,
+					   bh_leaf ? bh_leaf : bh_root, iblock,
+					   &grow_goal);
+		brelse(bh_leaf);
+		bh_leaf = NULL;
+		if (ret)
+			goto brelse_root;
+		goto again;
+	}
+
+	*bno = get_free_blocks(sb, goal, hole, len);
+	if (!*bno) {
+		ret = -ENOSPC;
+		goto brelse_leaf;
+	}
+
+	/* Extend the previous extent if possible, else insert a new one */
+	if (ext && ext->ee_block + ext->ee_len == iblock &&
+	    ext->ee_start + ext->ee_len == *bno) {
+		ext->ee_len += *len;
+	} else {
+		pos++;
+		ext = &leaf->extents[pos];
+		memmove(ext + 1, ext,
+			(leaf->header.nr_entries - pos) * sizeof(*ext));
+		ext->ee_block = iblock;
+		ext->ee_start = *bno;
+		ext->ee_len = *len;
+		leaf->header.nr_entries++;
+	}
+
+	/* Merge with the next extent if we filled the gap up to it */
+	if (pos + 1 < leaf->header.nr_entries) {
+		next_ext = ext + 1;
+		if (ext->ee_block + ext->ee_len == next_ext->ee_block &&
+		    ext->ee_start + ext->ee_len == next_ext->ee_start) {
+			ext->ee_len += next_ext->ee_len;
+			memmove(next_ext, next_ext + 1,
+				(leaf->header.nr_entries - pos - 2) *
+					sizeof(*ext));
+			leaf->header.nr_entries--;
+			memset(&leaf->extents[leaf->header.nr_entries], 0,
+			       sizeof(*ext));
+		}
+	}
+	mark_buffer_dirty_inode(bh_leaf ? bh_leaf : bh_root, inode);
+
+	inode->i_blocks += *len;
+	mark_inode_dirty(inode);
+	*new = true;
+
+brelse_leaf:
+	brelse(bh_leaf);
+brelse_root:
+	brelse(bh_root);
+unlock:
+	mutex_unlock(&ci->map_mutex);
+
+	return ret;
+}
+
+/*
+ * Free the blocks of leaf from iblock first on: extents starting at or after
+ * first are dropped, an extent crossing first is cut. Returns the number of
+ * blocks freed.
+ */
+static uint32_t
+ouichefs_extent_truncate_leaf(struct super_block *sb,
+			      struct ouichefs_extent_block *leaf,
+			      uint32_t first)
+{
+	struct ouichefs_extent *ext;
+	uint32_t keep, freed = 0;
+
+	while (leaf->header.nr_entries) {
+		ext = &leaf->extents[leaf->header.nr_entries - 1];
+		if (ext->ee_block + ext->ee_len <= first)
+			break;
+		keep = ext->ee_block < first ? first - ext->ee_block : 0;
+		ouichefs_free_data_blocks(sb, ext->ee_start + keep,
+					  ext->ee_len - keep);
+		freed += ext->ee_len - keep;
+		if (keep) {
+			ext->ee_len = keep;
+			break;
+		}
+		memset(ext, 0, sizeof(*ext));
+		leaf->header.nr_entries--;
+	}
+
+	return freed;
+}
+
+/*
+ * Free all blocks of inode from iblock first on, and the leaves left empty
+ * (the root goes back to depth 0 if all of them are). The page cache past
+ * first must have been truncated already. If blocks are freed, map_seq is
+ * bumped so that writeback doesn't reuse a mapping it cached.
+ */
+int ouichefs_extent_truncate(struct inode *inode, uint32_t first)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh_root, *bh_leaf;
+	struct ouichefs_extent_block *root, *leaf;
+	uint32_t freed = 0, leaf_freed;
+	int slot, ret = 0;
+
+	mutex_lock(&ci->map_mutex);
+	bh_root = ouichefs_index_bh(inode);
+	if (!bh_root) {
+		ret = -EIO;
+		goto unlock;
+	}
+	root = (struct ouichefs_extent_block *)bh_root->b_data;
+	if (!ouichefs_extent_block_ok(root, true)) {
+		pr_err("corrupted extent tree in inode %lu\n", inode->i_ino);
+		ret = -EUCLEAN;
+		goto brelse_root;
+	}
+
+	if (!root->header.depth) {
+		freed = ouichefs_extent_truncate_leaf(sb, root, first);
+		goto dirty;
+	}
+
+	/* Leaves are sorted, stop at the first one that keeps extents */
+	for (slot = root->header.nr_entries - 1; slot >= 0; slot--) {
+		bh_leaf = sb_bread(sb, root->idx[slot].ei_leaf);
+		if (!bh_leaf) {
+			ret = -EIO;
+			break;
+		}
+		leaf = (struct ouichefs_extent_block *)bh_leaf->b_data;
+		if (!ouichefs_extent_block_ok(leaf, false)) {
+			pr_err("corrupted extent leaf in inode %lu\n",
+			       inode->i_ino);
+			brelse(bh_leaf);
+			ret = -EUCLEAN;
+			break;
+		}
+
+		leaf_freed = ouichefs_extent_truncate_leaf(sb, leaf, first);
+		freed += leaf_freed;
+		if (leaf->header.nr_entries) {
+			if (leaf_freed)
+				mark_buffer_dirty_inode(bh_leaf, inode);
+			brelse(bh_leaf);
+			break;
+		}
+
+		/* Don't let the stale leaf be written over a reused block */
+		bforget(bh_leaf);
+		ouichefs_free_data_blocks(sb, root->idx[slot].ei_leaf, 1);
+		freed++;
+		memset(&root->idx[slot], 0, sizeof(root->idx[slot]));
+		root->header.nr_entries--;
+	}
+	if (!root->header.nr_entries)
+		ouichefs_extent_init_root(root);
+
+dirty:
+	if (freed) {
+		WRITE_ONCE(ci->map_seq, ci->map_seq + 1);
+		mark_buffer_dirty_inode(bh_root, inode);
+		inode->i_blocks -= freed;
+		mark_inode_dirty(inode);
+	}
+brelse_root:
+	brelse(bh_root);
+unlock:
+	mutex_unlock(&ci->map_mutex);
+
+	return ret;
+}
+
+static void ouichefs_extent_release_leaf(struct super_block *sb,
+					 struct ouichefs_extent_block *leaf)
+{
+	int i;
+
+	for (i = 0; i < leaf->header.nr_entries; i++)
+		ouichefs_free_data_blocks(sb, leaf->extents[i].ee_start,
+					  leaf->extents[i].ee_len);
+}
+
+/*
+ * Free all data and leaf blocks of the extent tree rooted in root (the index
+ * block of inode ino, which is left to the caller).
+ */
+void ouichefs_extent_release(struct super_block *sb, unsigned long ino,
+			     struct ouichefs_extent_block *root)
+{
+	struct buffer_head *bh;
+	struct ouichefs_extent_block *leaf;
+	int i;
+
+	if (!ouichefs_extent_block_ok(root, true)) {
+		pr_err("corrupted extent tree in inode %lu, its blocks are lost\n",
+		       ino);
+		return;
+	}
+
+	if (!root->header.depth) {
+		ouichefs_extent_release_leaf(sb, root);
+		return;
+	}
+
+	for (i = 0; i < root->header.nr_entries; i++) {
+		bh = sb_bread(sb, root->idx[i].ei_leaf);
+		if (bh) {
+			leaf = (struct ouichefs_extent_block *)bh->b_data;
+			if (ouichefs_extent_block_ok(leaf, false))
+				ouichefs_extent_release_leaf(sb, leaf);
+			brelse(bh);
+		}
+		ouichefs_free_data_blocks(sb, root->idx[i].ei_leaf, 1);
+	}
+}
@@ -0,0 +1,11 @@
+#ifndef _EXTENT_H
+#define _EXTENT_H
+void ouichefs_extent_init_root(struct ouichefs_extent_block *root);
+int ouichefs_extent_map(struct inode *inode, uint32_t iblock,
+			uint32_t max_blocks, bool create, uint32_t *bno,
+			uint32_t *len, bool *new);
+int ouichefs_extent_truncate(struct inode *inode, uint32_t first);
+void ouichefs_extent_release(struct super_block *sb, unsigned long ino,
+			     struct ouichefs_extent_block *root);
+
+#endif
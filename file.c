@@ -10,58 +10,71 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/buffer_head.h>
-#include <linux/mpage.h>
+#include <linux/iomap.h>
+#include <linux/blkdev.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
+#include "extent.h"
+#include "inode.h"
+#include "trace/events/ouichefs.h"
 
 /*
- * Map the buffer_head passed in argument with the iblock-th block of the file
- * represented by inode. If the requested block is not allocated and create is
- * true, allocate a new block on disk and map it.
+ * Map up to max_blocks blocks of a file using a single index block, starting
+ * at iblock (see ouichefs_map_blocks()).
  */
-static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
-				   struct buffer_head *bh_result, int create)
+static int ouichefs_index_map(struct inode *inode, uint32_t iblock,
+			      uint32_t max_blocks, bool create, uint32_t *bno,
+			      uint32_t *len, bool *new)
 {
 	struct super_block *sb = inode->i_sb;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
 	struct buffer_head *bh_index;
-	int ret = 0, bno;
-
-	/* If block number exceeds filesize, fail */
-	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
-		return -EFBIG;
+	uint32_t i, goal = 0;
+	int ret = 0;
 
-	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
+	/* Get the (pinned) index block */
+	bh_index = ouichefs_index_bh(inode);
 	if (!bh_index)
 		return -EIO;
 	index = (struct ouichefs_file_index_block *)bh_index->b_data;
 
 	/*
 	 * Check if iblock is already allocated. If not and create is true,
-	 * allocate it. Else, get the physical block number.
+	 * allocate it (and the following unallocated blocks asked for),
+	 * preferably right after the previous block of the file. Else, get the
+	 * physical block number.
 	 */
 	if (index->blocks[iblock] == 0) {
+		for (*len = 1; *len < max_blocks; (*len)++)
+			if (index->blocks[iblock + *len])
+				break;
 		if (!create) {
-			ret = 0;
+			*bno = 0;
 			goto brelse_index;
 		}
-		bno = get_free_block(sb);
-		if (!bno) {
+
+		if (iblock > 0 && index->blocks[iblock - 1])
+			goal = index->blocks[iblock - 1] + 1;
+
+		*bno = get_free_blocks(sb, goal, *len, len);
+		if (!*bno) {
 			ret = -ENOSPC;
 			goto brelse_index;
 		}
-		index->blocks[iblock] = bno;
+		for (i = 0; i < *len; i++)
+			index->blocks[iblock + i] = *bno + i;
+		mark_buffer_dirty_inode(bh_index, inode);
+		*new = true;
 	} else {
-		bno = index->blocks[iblock];
+		*bno = index->blocks[iblock];
+		for (*len = 1; *len < max_blocks; (*len)++)
+			if (index->blocks[iblock + *len] != *bno + *len)
+				break;
 	}
 
-	/* Map the physical block to the given buffer_head */
-	map_bh(bh_result, sb, bno);
-
 brelse_index:
 	brelse(bh_index);
 
@@ -69,78 +82,241 @@ brelse_index:
 }
 
 /*
- * Called by the page cache to read a page from the physical disk and map it in
- * memory.
+ * Map up to max_blocks blocks of the file represented by inode, starting at
+ * iblock. On success, *bno is the physical block of iblock and *len the number
+ * of physically contiguous blocks that follow. If iblock is not allocated, *bno
+ * is 0 and *len the size of the hole, unless create is true: we then allocate
+ * up to max_blocks contiguous blocks and set *new.
+ */
+static int ouichefs_map_blocks(struct inode *inode, sector_t iblock,
+			       uint32_t max_blocks, bool create, uint32_t *bno,
+			       uint32_t *len, bool *new)
+{
+	sector_t nr_blocks = (ouichefs_max_filesize(inode) +
+			      OUICHEFS_BLOCK_SIZE - 1) >> inode->i_blkbits;
+	int ret;
+
+	*new = false;
+
+	/* If block number exceeds filesize, fail */
+	if (iblock >= nr_blocks)
+		return -EFBIG;
+
+	max_blocks = clamp_t(sector_t, max_blocks, 1, nr_blocks - iblock);
+
+	if (OUICHEFS_INODE(inode)->i_flags & OUICHEFS_IFLAG_EXTENTS)
+		ret = ouichefs_extent_map(inode, iblock, max_blocks, create,
+					  bno, len, new);
+	else
+		ret = ouichefs_index_map(inode, iblock, max_blocks, create,
+					 bno, len, new);
+	trace_ouichefs_map_blocks(inode, iblock, max_blocks, create,
+				  ret ? 0 : *bno, ret ? 0 : *len, *new, ret);
+
+	return ret;
+}
+
+/*
+ * Fill iomap with the mapping of the file represented by inode at pos: the
+ * longest physically contiguous run of blocks (at most length bytes), or the
+ * hole at pos. For writes, holes are allocated (as many contiguous blocks as
+ * possible) and reported as IOMAP_F_NEW so iomap zeroes what isn't written.
+ * Zeroing leaves holes alone, they read as zeroes already.
+ */
+static int ouichefs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+				unsigned int flags, struct iomap *iomap,
+				struct iomap *srcmap)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	sector_t iblock = pos >> blkbits;
+	uint32_t max_blocks, bno, len;
+	bool create = (flags & IOMAP_WRITE) && !(flags & IOMAP_ZERO);
+	bool new;
+	int ret;
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->flags = 0;
+
+	/* Nothing can be mapped past the maximum file size */
+	if (pos >= ouichefs_max_filesize(inode)) {
+		if (create)
+			return -EFBIG;
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->offset = pos;
+		iomap->length = length;
+		return 0;
+	}
+
+	max_blocks = min_t(u64, ((pos + length - 1) >> blkbits) - iblock + 1,
+			   U32_MAX);
+	ret = ouichefs_map_blocks(inode, iblock, max_blocks, create, &bno, &len,
+				  &new);
+	if (ret)
+		return ret;
+
+	iomap->offset = (loff_t)iblock << blkbits;
+	iomap->length = (u64)len << blkbits;
+	if (!bno) {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+	} else {
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = (u64)bno << blkbits;
+		if (new) {
+			/*
+			 * Freed blocks may be scrubbed through the buffer
+			 * cache, don't let these buffers overwrite our data
+			 * later.
+			 */
+			clean_bdev_aliases(iomap->bdev, bno, len);
+			iomap->flags |= IOMAP_F_NEW;
+		}
+	}
+
+	return 0;
+}
+
+static const struct iomap_ops ouichefs_iomap_ops = {
+	.iomap_begin = ouichefs_iomap_begin,
+};
+
+/*
+ * Called by the page cache to read a folio from the physical disk and map it
+ * in memory.
+ */
+static int ouichefs_read_folio(struct file *file, struct folio *folio)
+{
+	return iomap_read_folio(folio, &ouichefs_iomap_ops);
+}
+
+/*
+ * Called by the page cache to read several folios ahead, contiguous blocks
+ * are read with large bios.
  */
 static void ouichefs_readahead(struct readahead_control *rac)
 {
-	mpage_readahead(rac, ouichefs_file_get_block);
+	iomap_readahead(rac, &ouichefs_iomap_ops);
 }
 
 /*
- * Called by the page cache to write a dirty page to the physical disk (when
+ * Map the dirty block at offset for writeback. Blocks are allocated when they
+ * are written to the page cache, by write() or ouichefs_page_mkwrite(), so
+ * writeback never allocates (which could evict files from reclaim context): a
+ * hole here is an error.
+ * We map the whole contiguous run up to the end of the file: the following
+ * dirty folios of the run reuse this mapping (unless blocks of the file were
+ * freed meanwhile) and iomap merges them into the same bio.
+ */
+static int ouichefs_writeback_map_blocks(struct iomap_writepage_ctx *wpc,
+					 struct inode *inode, loff_t offset)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	loff_t end = round_up(i_size_read(inode), i_blocksize(inode));
+	unsigned int seq = READ_ONCE(ci->map_seq);
+	int ret;
+
+	if (wpc->iomap.type == IOMAP_MAPPED && offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length &&
+	    wpc->iomap.validity_cookie == seq)
+		return 0;
+
+	ret = ouichefs_iomap_begin(inode, offset,
+				   max_t(loff_t, end - offset,
+					 i_blocksize(inode)),
+				   0, &wpc->iomap, NULL);
+	if (!ret && wpc->iomap.type == IOMAP_HOLE) {
+		pr_err("dirty hole at %lld in inode %lu\n", offset,
+		       inode->i_ino);
+		ret = -EIO;
+	}
+	wpc->iomap.validity_cookie = seq;
+
+	return ret;
+}
+
+static const struct iomap_writeback_ops ouichefs_writeback_ops = {
+	.map_blocks = ouichefs_writeback_map_blocks,
+};
+
+/*
+ * Called by the page cache to write dirty folios to the physical disk (when
  * sync is called or when memory is needed).
  */
-static int ouichefs_writepage(struct page *page, struct writeback_control *wbc)
+static int ouichefs_writepages(struct address_space *mapping,
+			       struct writeback_control *wbc)
 {
-	return block_write_full_page(page, ouichefs_file_get_block, wbc);
+	struct iomap_writepage_ctx wpc = {};
+
+	return iomap_writepages(mapping, wbc, &wpc, &ouichefs_writeback_ops);
+}
+
+static sector_t ouichefs_bmap(struct address_space *mapping, sector_t block)
+{
+	return iomap_bmap(mapping, block, &ouichefs_iomap_ops);
+}
+
+static int ouichefs_fiemap(struct inode *inode,
+			   struct fiemap_extent_info *fieinfo, u64 start,
+			   u64 len)
+{
+	return iomap_fiemap(inode, fieinfo, start, len, &ouichefs_iomap_ops);
 }
 
 /*
- * Called by the VFS when a write() syscall occurs on file before writing the
- * data in the page cache. This functions checks if the write will be able to
- * complete and allocates the necessary blocks through block_write_begin().
+ * Check if a write of count bytes at pos will be able to complete (enough
+ * space?).
  */
-static int ouichefs_write_begin(struct file *file,
-				struct address_space *mapping, loff_t pos,
-				unsigned int len, struct page **pagep,
-				void **fsdata)
+static int ouichefs_write_check(struct inode *inode, loff_t pos, size_t count)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
-	int err;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
 	uint32_t nr_allocs = 0;
 
-	/* Check if the write can be completed (enough space?) */
-	if (pos + len > OUICHEFS_MAX_FILESIZE)
+	if (pos + count > ouichefs_max_filesize(inode))
 		return -ENOSPC;
-	nr_allocs = max(pos + len, file->f_inode->i_size) / OUICHEFS_BLOCK_SIZE;
-	if (nr_allocs > file->f_inode->i_blocks - 1)
-		nr_allocs -= file->f_inode->i_blocks - 1;
+	nr_allocs = max_t(loff_t, pos + count, inode->i_size) /
+		    OUICHEFS_BLOCK_SIZE;
+	if (nr_allocs > inode->i_blocks - 1)
+		nr_allocs -= inode->i_blocks - 1;
 	else
 		nr_allocs = 0;
-	if (nr_allocs > sbi->nr_free_blocks)
+	if (nr_allocs > ouichefs_nr_available_blocks(sbi))
 		return -ENOSPC;
 
-	/* prepare the write */
-	err = block_write_begin(mapping, pos, len, pagep,
-				ouichefs_file_get_block);
-	/* if this failed, reclaim newly allocated blocks */
-	if (err < 0) {
-		pr_err("%s:%d: newly allocated blocks reclaim not implemented yet\n",
-		       __func__, __LINE__);
-	}
-	return err;
+	return 0;
 }
 
 /*
- * Called by the VFS after writing data from a write() syscall to the page
- * cache. This functions updates inode metadata and truncates the file if
- * necessary.
+ * Free the blocks of a file with extents past its size, once the page cache
+ * is truncated.
  */
-static int ouichefs_write_end(struct file *file, struct address_space *mapping,
-			      loff_t pos, unsigned int len, unsigned int copied,
-			      struct page *page, void *fsdata)
+static void ouichefs_truncate_blocks(struct inode *inode)
 {
-	int ret;
-	struct inode *inode = file->f_inode;
+	uint32_t first = DIV_ROUND_UP(i_size_read(inode), OUICHEFS_BLOCK_SIZE);
+
+	if (ouichefs_extent_truncate(inode, first))
+		pr_err("failed truncating inode %lu, blocks are lost\n",
+		       inode->i_ino);
+}
+
+/*
+ * Called after writing data from a write() syscall to the page cache. This
+ * functions updates inode metadata and truncates the file if necessary.
+ */
+static void ouichefs_write_done(struct file *file)
+{
+	struct inode *inode = file_inode(file);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
 
-	/* Complete the write() */
-	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-	if (ret < len) {
-		pr_err("%s:%d: wrote less than asked... what do I do? nothing for now...\n",
-		       __func__, __LINE__);
+	if (ci->i_flags & OUICHEFS_IFLAG_EXTENTS) {
+		/*
+		 * i_blocks is kept up to date by the extent tree. A short write
+		 * can leave blocks allocated past the end of the file.
+		 */
+		inode->i_mtime = inode->i_ctime = current_time(inode);
+		mark_inode_dirty(inode);
+		ouichefs_truncate_blocks(inode);
 	} else {
 		uint32_t nr_blocks_old = inode->i_blocks;
 
@@ -157,14 +333,15 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 
 			/* Free unused blocks from page cache */
 			truncate_pagecache(inode, inode->i_size);
+			WRITE_ONCE(ci->map_seq, ci->map_seq + 1);
 
 			/* Read index block to remove unused blocks */
-			bh_index = sb_bread(sb, ci->index_block);
+			bh_index = ouichefs_index_bh(inode);
 			if (!bh_index) {
 				pr_err("failed truncating '%s'. we just lost %llu blocks\n",
 				       file->f_path.dentry->d_name.name,
 				       nr_blocks_old - inode->i_blocks);
-				goto end;
+				return;
 			}
 			index = (struct ouichefs_file_index_block *)
 					bh_index->b_data;
@@ -174,24 +351,304 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 				put_block(OUICHEFS_SB(sb), index->blocks[i]);
 				index->blocks[i] = 0;
 			}
-			mark_buffer_dirty(bh_index);
+			mark_buffer_dirty_inode(bh_index, inode);
 			brelse(bh_index);
 		}
 	}
-end:
+}
+
+/*
+ * Update the file size once a direct write extending the file is on disk.
+ */
+static int ouichefs_dio_write_end_io(struct kiocb *iocb, ssize_t size,
+				     int error, unsigned int flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	if (error)
+		return error;
+	if (size && iocb->ki_pos + size > i_size_read(inode))
+		i_size_write(inode, iocb->ki_pos + size);
+
+	return 0;
+}
+
+static const struct iomap_dio_ops ouichefs_dio_write_ops = {
+	.end_io = ouichefs_dio_write_end_io,
+};
+
+/*
+ * Write through the page cache. Up to 6.5, iomap_file_buffered_write() doesn't
+ * advance the file position itself.
+ */
+static ssize_t ouichefs_buffered_write(struct kiocb *iocb,
+				       struct iov_iter *from)
+{
+	ssize_t ret;
+
+	ret = iomap_file_buffered_write(iocb, from, &ouichefs_iomap_ops);
+	if (ret > 0)
+		iocb->ki_pos += ret;
+
+	return ret;
+}
+
+/*
+ * Write directly to disk, bypassing the page cache. Blocks are allocated by
+ * ouichefs_iomap_begin() like for buffered writes. We wait for the I/O even
+ * for async requests so the size is updated with the inode locked. Whatever
+ * can't be written directly (e.g. the page cache couldn't be invalidated) is
+ * written through the page cache.
+ */
+static ssize_t ouichefs_dio_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	ssize_t ret, buffered;
+	loff_t pos, end;
+	int err;
+
+	ret = iomap_dio_rw(iocb, from, &ouichefs_iomap_ops,
+			   &ouichefs_dio_write_ops, IOMAP_DIO_FORCE_WAIT, NULL,
+			   0);
+	if (ret == -ENOTBLK)
+		ret = 0;
+	if (ret < 0 || !iov_iter_count(from))
+		return ret;
+
+	/*
+	 * Write the rest through the page cache, then write it back and drop
+	 * it from the cache so that O_DIRECT semantics are kept (6.5 has no
+	 * direct_write_fallback()).
+	 */
+	pos = iocb->ki_pos;
+	buffered = ouichefs_buffered_write(iocb, from);
+	if (buffered <= 0)
+		return ret ? ret : buffered;
+
+	end = pos + buffered - 1;
+	err = filemap_write_and_wait_range(mapping, pos, end);
+	if (err) {
+		/* We don't know how much reached the disk */
+		iocb->ki_pos = pos;
+		return ret ? ret : err;
+	}
+	invalidate_mapping_pages(mapping, pos >> PAGE_SHIFT, end >> PAGE_SHIFT);
+
+	return ret + buffered;
+}
+
+/*
+ * Called by the VFS when a read() syscall occurs on file. O_DIRECT reads go
+ * straight to disk, others through the page cache.
+ */
+static ssize_t ouichefs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	inode_lock_shared(inode);
+	ret = iomap_dio_rw(iocb, to, &ouichefs_iomap_ops, NULL, 0, NULL, 0);
+	inode_unlock_shared(inode);
+	file_accessed(iocb->ki_filp);
+
+	return ret;
+}
+
+/*
+ * Called by the VFS when a write() syscall occurs on file. Blocks are
+ * allocated through ouichefs_iomap_begin() while the data is copied to the
+ * page cache (or written directly to disk for O_DIRECT).
+ */
+static ssize_t ouichefs_file_write_iter(struct kiocb *iocb,
+					struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	ssize_t ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto unlock;
+	ret = ouichefs_write_check(inode, iocb->ki_pos, iov_iter_count(from));
+	if (ret)
+		goto unlock;
+	ret = file_remove_privs(file);
+	if (ret)
+		goto unlock;
+
+	if (iocb->ki_flags & IOCB_DIRECT)
+		ret = ouichefs_dio_write(iocb, from);
+	else
+		ret = ouichefs_buffered_write(iocb, from);
+	if (ret > 0)
+		ouichefs_write_done(file);
+
+unlock:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+
 	return ret;
 }
 
+/*
+ * Make a file or directory durable. __generic_file_fsync() writes the data,
+ * the metadata blocks attached to the inode by mark_buffer_dirty_inode()
+ * (index block, extent leaves, directory blocks) and the inode itself. The
+ * inodes and blocks allocated for the file are only recorded in the free
+ * bitmaps, so their changed blocks are written too before the cache flush.
+ */
+int ouichefs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int ret;
+
+	ret = __generic_file_fsync(file, start, end, datasync);
+	if (ret)
+		return ret;
+	ret = ouichefs_bitmap_sync(sb, &sbi->ifree, 1);
+	if (ret)
+		return ret;
+	ret = ouichefs_bitmap_sync(sb, &sbi->bfree, 1);
+	if (ret)
+		return ret;
+
+	return blkdev_issue_flush(sb->s_bdev);
+}
+
 const struct address_space_operations ouichefs_aops = {
+	.read_folio = ouichefs_read_folio,
 	.readahead = ouichefs_readahead,
-	.writepage = ouichefs_writepage,
-	.write_begin = ouichefs_write_begin,
-	.write_end = ouichefs_write_end
+	.writepages = ouichefs_writepages,
+	.dirty_folio = filemap_dirty_folio,
+	.release_folio = iomap_release_folio,
+	.invalidate_folio = iomap_invalidate_folio,
+	.bmap = ouichefs_bmap,
+	.direct_IO = noop_direct_IO,
+	.migrate_folio = filemap_migrate_folio,
+	.is_partially_uptodate = iomap_is_partially_uptodate,
+	.error_remove_page = generic_error_remove_page,
+};
+
+/*
+ * Called before a page of a shared mapping is made writable: allocate its
+ * blocks like a write() would, so that writeback only has to map them. Pages
+ * past the end of the file can't be written, so legacy files don't need their
+ * i_blocks updated (it is computed from the size).
+ */
+static vm_fault_t ouichefs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct file *file = vmf->vma->vm_file;
+	struct inode *inode = file_inode(file);
+	vm_fault_t ret;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(file);
+	/* Excludes truncation, see ouichefs_setattr() */
+	filemap_invalidate_lock_shared(inode->i_mapping);
+	ret = iomap_page_mkwrite(vmf, &ouichefs_iomap_ops);
+	filemap_invalidate_unlock_shared(inode->i_mapping);
+	sb_end_pagefault(inode->i_sb);
+
+	return ret;
+}
+
+static const struct vm_operations_struct ouichefs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = ouichefs_page_mkwrite,
 };
 
+static int ouichefs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &ouichefs_file_vm_ops;
+
+	return 0;
+}
+
+/*
+ * Opening and closing a file are events the eviction policy might want to
+ * score the file again on.
+ */
+static int ouichefs_file_open(struct inode *inode, struct file *file)
+{
+	int ret = generic_file_open(inode, file);
+
+	if (!ret)
+		eviction_tracker_index_update(inode, EVICTION_EVENT_OPEN);
+	return ret;
+}
+
+static int ouichefs_file_release(struct inode *inode, struct file *file)
+{
+	eviction_tracker_index_update(inode, EVICTION_EVENT_OPEN);
+	return 0;
+}
+
 const struct file_operations ouichefs_file_ops = {
 	.owner = THIS_MODULE,
+	.open = ouichefs_file_open,
+	.release = ouichefs_file_release,
 	.llseek = generic_file_llseek,
-	.read_iter = generic_file_read_iter,
-	.write_iter = generic_file_write_iter
+	.read_iter = ouichefs_file_read_iter,
+	.write_iter = ouichefs_file_write_iter,
+	.mmap = ouichefs_file_mmap,
+	.fsync = ouichefs_fsync,
+};
+
+/*
+ * Change the attributes of a file. Shrinking a file with extents frees its
+ * blocks past the new size, so that they can't show up again if the file is
+ * extended. Legacy files are shrunk by ouichefs_write_done() on the next write.
+ */
+static int ouichefs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
+			    struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	loff_t size = attr->ia_size;
+	int ret;
+
+	ret = setattr_prepare(idmap, dentry, attr);
+	if (ret)
+		return ret;
+
+	if ((attr->ia_valid & ATTR_SIZE) && size != i_size_read(inode)) {
+		if (size > ouichefs_max_filesize(inode))
+			return -EFBIG;
+
+		filemap_invalidate_lock(inode->i_mapping);
+		/* The end of the new last block must read as zeroes */
+		if (size < i_size_read(inode)) {
+			ret = iomap_truncate_page(inode, size, NULL,
+						  &ouichefs_iomap_ops);
+			if (ret) {
+				filemap_invalidate_unlock(inode->i_mapping);
+				return ret;
+			}
+		}
+		truncate_setsize(inode, size);
+		if (ci->i_flags & OUICHEFS_IFLAG_EXTENTS)
+			ouichefs_truncate_blocks(inode);
+		filemap_invalidate_unlock(inode->i_mapping);
+	}
+
+	setattr_copy(idmap, inode, attr);
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+const struct inode_operations ouichefs_file_inode_ops = {
+	.setattr = ouichefs_setattr,
+	.fiemap = ouichefs_fiemap,
 };
@@ -20,42 +20,122 @@
 #include "fs.h"
 #include "inode.h"
 #include "eviction_tracker.h"
+#include "sysfs.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace/events/ouichefs.h"
 
 MODULE_PARM_DESC(
 	eviction_percentage_threshold,
 	"Parameter how many blocks can be free before eviction is triggered (in %%) (Default: 10)");
+MODULE_PARM_DESC(
+	eviction_low_watermark,
+	"Free blocks (in %%) below which eviction is started in the background (Default: 20)");
+MODULE_PARM_DESC(
+	eviction_high_watermark,
+	"Free blocks (in %%) the background eviction tries to reach (Default: 30)");
+MODULE_PARM_DESC(
+	scrub_mode,
+	"What to do with the data blocks of destroyed files: zero, discard or none (Default: zero)");
+MODULE_PARM_DESC(
+	eviction_raw_scan,
+	"Compare eviction candidates using the on-disk inodes instead of reading them into the inode cache (Default: N)");
+MODULE_PARM_DESC(
+	dir_max_entries,
+	"Number of files of a directory above which a file is evicted on create, 0 for no limit - legacy directories are limited to 128 files anyway (Default: 4096)");
 
-/* Setter function used by struct kernel_parm_ops */
-static int set_eviction_percentage_threshold(const char *val,
-					     const struct kernel_param *kp)
+/* Setter function used by struct kernel_parm_ops for all percentages */
+static int set_eviction_percentage(const char *val,
+				   const struct kernel_param *kp)
 {
-	pr_info("Setting eviction_percentage_threshold to %s (currently: %d)\n",
-		val, eviction_percentage_threshold);
-	int ret = param_set_int(val, kp);
+	int *param = kp->arg;
+	int new_value;
+
+	pr_info("Setting %s to %s (currently: %d)\n", kp->name, val, *param);
+	int ret = kstrtoint(val, 0, &new_value);
 
 	if (ret < 0)
 		return ret;
 
-	if (eviction_percentage_threshold < 0 ||
-	    eviction_percentage_threshold >= 100) {
-		pr_err("Invalid eviction_percentage_threshold: %d - must be >= 0 and < 100\n",
-		       eviction_percentage_threshold);
+	if (new_value < 0 || new_value >= 100) {
+		pr_err("Invalid %s: %d - must be >= 0 and < 100\n", kp->name,
+		       new_value);
 		return -EINVAL;
 	}
 
-	pr_info("eviction_percentage_threshold set to %d\n",
-		eviction_percentage_threshold);
+	*param = new_value;
+	pr_info("%s set to %d\n", kp->name, new_value);
 	return 0;
 }
 
-static const struct kernel_param_ops eviction_percentage_threshold_ops = {
+static const struct kernel_param_ops eviction_percentage_ops = {
 	.get = param_get_int,
-	.set = set_eviction_percentage_threshold,
+	.set = set_eviction_percentage,
 };
 
-module_param_cb(eviction_percentage_threshold,
-		&eviction_percentage_threshold_ops,
+module_param_cb(eviction_percentage_threshold, &eviction_percentage_ops,
 		&eviction_percentage_threshold, 0664);
+module_param_cb(eviction_low_watermark, &eviction_percentage_ops,
+		&eviction_low_watermark, 0664);
+module_param_cb(eviction_high_watermark, &eviction_percentage_ops,
+		&eviction_high_watermark, 0664);
+
+static int set_dir_max_entries(const char *val, const struct kernel_param *kp)
+{
+	int new_value;
+	int ret = kstrtoint(val, 0, &new_value);
+
+	if (ret < 0)
+		return ret;
+
+	if (new_value < 0) {
+		pr_err("Invalid %s: %d - must be >= 0\n", kp->name, new_value);
+		return -EINVAL;
+	}
+
+	dir_max_entries = new_value;
+	pr_info("%s set to %d\n", kp->name, new_value);
+	return 0;
+}
+
+static const struct kernel_param_ops dir_max_entries_ops = {
+	.get = param_get_int,
+	.set = set_dir_max_entries,
+};
+
+module_param_cb(dir_max_entries, &dir_max_entries_ops, &dir_max_entries,
+		0664);
+
+/* Indexed by enum ouichefs_scrub_mode */
+static const char * const scrub_modes[] = { "zero", "discard", "none" };
+
+static int set_scrub_mode(const char *val, const struct kernel_param *kp)
+{
+	int mode = sysfs_match_string(scrub_modes, val);
+
+	if (mode < 0) {
+		pr_err("Invalid %s: %s - must be zero, discard or none\n",
+		       kp->name, val);
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(scrub_mode, mode);
+	pr_info("%s set to %s\n", kp->name, scrub_modes[mode]);
+	return 0;
+}
+
+static int get_scrub_mode(char *buffer, const struct kernel_param *kp)
+{
+	return sysfs_emit(buffer, "%s\n", scrub_modes[READ_ONCE(scrub_mode)]);
+}
+
+static const struct kernel_param_ops scrub_mode_ops = {
+	.get = get_scrub_mode,
+	.set = set_scrub_mode,
+};
+
+module_param_cb(scrub_mode, &scrub_mode_ops, &scrub_mode, 0664);
+module_param(eviction_raw_scan, bool, 0664);
 
 static ssize_t ouichefs_evict_store_general(struct kobject *kobj,
 					    struct kobj_attribute *attr,
@@ -77,19 +157,10 @@ static ssize_t ouichefs_evict_store_general(struct kobject *kobj,
 		return -EINVAL;
 	}
 
-	/* Get inode for eviction */
-	struct eviction_tracker_scan_result result;
-
-	if (!eviction_tracker_get_inode_for_eviction(d_inode(path.dentry),
-						     recurse, &result)) {
-		pr_err("Eviction failed for device %d and folder %s\n",
-		       path.dentry->d_sb->s_dev, path.dentry->d_name.name);
-		path_put(&path);
-		return -ENOENT;
-	}
-
 	/* Trigger eviction for the target folder */
-	ret = ouichefs_unlink_inode(result.parent, result.best_candidate);
+	ret = eviction_tracker_evict(d_inode(path.dentry), recurse, false, 0,
+				     EVICTION_TRIGGER_MANUAL,
+				     "manual eviction");
 
 	if (ret < 0) {
 		pr_err("Eviction failed for device %d and folder %s\n",
@@ -98,26 +169,6 @@ static ssize_t ouichefs_evict_store_general(struct kobject *kobj,
 		return ret;
 	}
 
-	/*
-	 * Hacky bugfix: we use inodes to unlink files instead of dentries
-	 * so we need to prune leftover aliases in the dcache
-	 * after unlinking the inode.
-	 * If we used vfs_unlink() instead of ouichefs_unlink_inode() we
-	 * probably wouldn't need to do this
-	 * If we don't do this, something like this will fail:
-	 * $ touch file1
-	 * (trigger eviction of file1)
-	 * $ touch file1
-	 * --> file1 won't be created again because it's still in the dcache
-	 *
-	 * This will probably also remove hardlink aliases from dcache and
-	 * thus could hurt performance a little bit when using hardlinks
-	*/
-	d_prune_aliases(result.best_candidate);
-
-	iput(result.best_candidate);
-	iput(result.parent);
-
 	path_put(&path);
 	return count;
 }
@@ -150,7 +201,7 @@ static struct kobj_attribute ouichefs_evict_recursive_attribute =
 static struct kobj_attribute ouichefs_evict_attribute =
 	__ATTR(evict, 0664, NULL, ouichefs_evict_store);
 
-static struct kobject *ouichefs_kobject;
+struct kobject *ouichefs_kobject;
 
 /*
  * Mount a ouiche_fs partition
@@ -175,6 +226,17 @@ struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
  */
 void ouichefs_kill_sb(struct super_block *sb)
 {
+	/*
+	 * Stop background eviction and drop the references the eviction
+	 * index holds before shutdown
+	 */
+	if (OUICHEFS_SB(sb)) {
+		eviction_tracker_worker_stop(sb);
+		eviction_tracker_index_destroy(sb);
+		/* The bitmaps are written back for the last time below */
+		ouichefs_free_worker_flush(sb);
+	}
+
 	kill_block_super(sb);
 
 	pr_info("unmounted disk\n");
@@ -4,4 +4,19 @@
 /* Parameter how many blocks can be free before eviction is triggered (in %) */
 int eviction_percentage_threshold = 10;
 
+/* Free blocks (in %) below which background eviction is started */
+int eviction_low_watermark = 20;
+
+/* Free blocks (in %) up to which background eviction evicts */
+int eviction_high_watermark = 30;
+
+/* Number of files of a directory above which we evict on create (0: none) */
+int dir_max_entries = 4096;
+
+/* What to do with the data blocks of destroyed files */
+int scrub_mode = OUICHEFS_SCRUB_ZERO;
+
+/* Compare eviction candidates using the inode store, see eviction_tracker.c */
+bool eviction_raw_scan;
+
 #endif
@@ -11,15 +11,73 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/blkdev.h>
 
 #include "inode.h"
+#include "dir.h"
 #include "ouichefs.h"
 #include "bitmap.h"
+#include "extent.h"
 #include "eviction_tracker.h"
 
 static const struct inode_operations ouichefs_inode_ops;
 static const struct inode_operations ouichefs_symlink_inode_ops;
 
+/*
+ * Copy the attributes of the on-disk inode cinode (mode, owner, size, times and
+ * block count) to inode.
+ */
+static void ouichefs_inode_attrs(struct inode *inode,
+				 struct ouichefs_inode *cinode)
+{
+	inode->i_mode = le32_to_cpu(cinode->i_mode) & ~OUICHEFS_IFLAGS_MASK;
+	i_uid_write(inode, le32_to_cpu(cinode->i_uid));
+	i_gid_write(inode, le32_to_cpu(cinode->i_gid));
+	inode->i_size = le32_to_cpu(cinode->i_size);
+	inode->i_ctime.tv_sec = (time64_t)le32_to_cpu(cinode->i_ctime);
+	inode->i_ctime.tv_nsec = 0;
+	inode->i_atime.tv_sec = (time64_t)le32_to_cpu(cinode->i_atime);
+	inode->i_atime.tv_nsec = 0;
+	inode->i_mtime.tv_sec = (time64_t)le32_to_cpu(cinode->i_mtime);
+	inode->i_mtime.tv_nsec = 0;
+	inode->i_blocks = le32_to_cpu(cinode->i_blocks);
+}
+
+/*
+ * Read the attributes of inode ino given to the eviction policies from the
+ * inode store, without getting it from the inode cache.
+ */
+int ouichefs_read_inode_attrs(struct super_block *sb, unsigned long ino,
+			      struct eviction_candidate_attrs *attrs)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode *cinode;
+	struct buffer_head *bh;
+
+	if (ino >= sbi->nr_inodes)
+		return -EINVAL;
+
+	bh = sb_bread(sb, ino / OUICHEFS_INODES_PER_BLOCK + 1);
+	if (!bh)
+		return -EIO;
+	cinode = (struct ouichefs_inode *)bh->b_data +
+		 ino % OUICHEFS_INODES_PER_BLOCK;
+	attrs->ino = ino;
+	attrs->mode = le32_to_cpu(cinode->i_mode) & ~OUICHEFS_IFLAGS_MASK;
+	attrs->size = le32_to_cpu(cinode->i_size);
+	attrs->blocks = le32_to_cpu(cinode->i_blocks);
+	attrs->ctime.tv_sec = (time64_t)le32_to_cpu(cinode->i_ctime);
+	attrs->ctime.tv_nsec = 0;
+	attrs->atime.tv_sec = (time64_t)le32_to_cpu(cinode->i_atime);
+	attrs->atime.tv_nsec = 0;
+	attrs->mtime.tv_sec = (time64_t)le32_to_cpu(cinode->i_mtime);
+	attrs->mtime.tv_nsec = 0;
+	attrs->nlink = le32_to_cpu(cinode->i_nlink);
+	brelse(bh);
+
+	return 0;
+}
+
 /*
  * Get inode ino from disk.
  */
@@ -43,6 +101,7 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	if (!inode)
 		return ERR_PTR(-ENOMEM);
 	/* If inode is in cache, return it */
+	trace_ouichefs_iget(sb, ino, !(inode->i_state & I_NEW));
 	if (!(inode->i_state & I_NEW))
 		return inode;
 
@@ -60,24 +119,16 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	inode->i_sb = sb;
 	inode->i_op = &ouichefs_inode_ops;
 
-	inode->i_mode = le32_to_cpu(cinode->i_mode);
-	i_uid_write(inode, le32_to_cpu(cinode->i_uid));
-	i_gid_write(inode, le32_to_cpu(cinode->i_gid));
-	inode->i_size = le32_to_cpu(cinode->i_size);
-	inode->i_ctime.tv_sec = (time64_t)le32_to_cpu(cinode->i_ctime);
-	inode->i_ctime.tv_nsec = 0;
-	inode->i_atime.tv_sec = (time64_t)le32_to_cpu(cinode->i_atime);
-	inode->i_atime.tv_nsec = 0;
-	inode->i_mtime.tv_sec = (time64_t)le32_to_cpu(cinode->i_mtime);
-	inode->i_mtime.tv_nsec = 0;
-	inode->i_blocks = le32_to_cpu(cinode->i_blocks);
+	ouichefs_inode_attrs(inode, cinode);
 	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
 
 	ci->index_block = le32_to_cpu(cinode->index_block);
+	ci->i_flags = le32_to_cpu(cinode->i_mode) & OUICHEFS_IFLAGS_MASK;
 
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
 	} else if (S_ISREG(inode->i_mode)) {
+		inode->i_op = &ouichefs_file_inode_ops;
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
 	} else if (S_ISLNK(inode->i_mode)) {
@@ -99,6 +150,32 @@ failed:
 	return ERR_PTR(ret);
 }
 
+/*
+ * Get the index block of inode. It is read once and then stays pinned in
+ * ouichefs_inode_info until the inode is evicted from memory, so mapping a
+ * block doesn't look the index block up in the buffer cache every time.
+ * Release the returned buffer_head with brelse() as usual.
+ */
+struct buffer_head *ouichefs_index_bh(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh = READ_ONCE(ci->index_bh);
+
+	if (!bh) {
+		bh = sb_bread(inode->i_sb, ci->index_block);
+		if (!bh)
+			return NULL;
+		/* Someone else pinned it first, use theirs */
+		if (cmpxchg(&ci->index_bh, NULL, bh)) {
+			brelse(bh);
+			bh = ci->index_bh;
+		}
+	}
+	get_bh(bh);
+
+	return bh;
+}
+
 /*
  * Look for dentry in dir.
  * Fill dentry with NULL if not in dir, with the corresponding inode if found.
@@ -108,35 +185,20 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 				      unsigned int flags)
 {
 	struct super_block *sb = dir->i_sb;
-	struct ouichefs_inode_info *ci_dir = OUICHEFS_INODE(dir);
 	struct inode *inode = NULL;
-	struct buffer_head *bh = NULL;
-	struct ouichefs_dir_block *dblock = NULL;
-	struct ouichefs_file *f = NULL;
-	int i;
+	uint32_t ino;
+	int ret;
 
 	/* Check filename length */
 	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
 		return ERR_PTR(-ENAMETOOLONG);
 
-	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return ERR_PTR(-EIO);
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-
 	/* Search for the file in directory */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		f = &dblock->files[i];
-		if (!f->inode)
-			break;
-		if (!strncmp(f->filename, dentry->d_name.name,
-			     OUICHEFS_FILENAME_LEN)) {
-			inode = ouichefs_iget(sb, f->inode);
-			break;
-		}
-	}
-	brelse(bh);
+	ret = ouichefs_dir_lookup(dir, &dentry->d_name, &ino);
+	if (!ret)
+		inode = ouichefs_iget(sb, ino);
+	else if (ret != -ENOENT)
+		return ERR_PTR(ret);
 
 	/* Update directory access time */
 	dir->i_atime = current_time(dir);
@@ -170,11 +232,15 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	sb = dir->i_sb;
 	sbi = OUICHEFS_SB(sb);
 
-	if (sbi->nr_free_inodes == 0 || sbi->nr_free_blocks == 0)
+	if (!ouichefs_has_free(&sbi->free_inodes) ||
+	    !ouichefs_has_free(&sbi->free_blocks))
 		return ERR_PTR(-ENOSPC);
 
-	/* Get a new free inode */
-	ino = get_free_inode(sbi);
+	/*
+	 * Get a new free inode, close to the parent for files (directories
+	 * are spread over the allocation groups)
+	 */
+	ino = get_free_inode(sbi, S_ISDIR(mode) ? 0 : dir->i_ino);
 	if (!ino)
 		return ERR_PTR(-ENOSPC);
 	inode = ouichefs_iget(sb, ino);
@@ -191,6 +257,7 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 		goto put_inode;
 	}
 	ci->index_block = bno;
+	ci->i_flags = 0;
 
 	/* Initialize inode */
 	inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
@@ -199,11 +266,16 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 		inode->i_size = OUICHEFS_BLOCK_SIZE;
 		inode->i_fop = &ouichefs_dir_ops;
 		set_nlink(inode, 2); /* . and .. */
+		if (sbi->features & OUICHEFS_FEATURE_HASHED_DIRS)
+			ci->i_flags |= OUICHEFS_IFLAG_HASHED;
 	} else if (S_ISREG(mode)) {
 		inode->i_size = 0;
+		inode->i_op = &ouichefs_file_inode_ops;
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
 		set_nlink(inode, 1);
+		if (sbi->features & OUICHEFS_FEATURE_EXTENTS)
+			ci->i_flags |= OUICHEFS_IFLAG_EXTENTS;
 	} else if (S_ISLNK(mode)) {
 		inode->i_size = 0;
 		inode->i_op = &ouichefs_symlink_inode_ops;
@@ -234,81 +306,52 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 {
 	struct super_block *sb;
 	struct inode *inode;
-	struct ouichefs_inode_info *ci_dir;
-	struct ouichefs_dir_block *dblock;
 	char *fblock;
-	struct buffer_head *bh, *bh2;
-	int ret = 0, i;
+	struct buffer_head *bh2;
+	int ret = 0;
 
 	/* Check filename length */
 	if (strlen(dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
 		return -ENAMETOOLONG;
 
-	/* Read parent directory index */
-	ci_dir = OUICHEFS_INODE(dir);
-	sb = dir->i_sb;
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-
 	/* Check if parent directory is full */
-	if (dblock->files[OUICHEFS_MAX_SUBFILES - 1].inode != 0) {
-		struct eviction_tracker_scan_result result;
-
-		if (!eviction_tracker_get_inode_for_eviction(dir, false,
-							     &result)) {
-			ret = -EMLINK;
-			goto end;
-		}
-
-		pr_info("parent directory full - evicting inode %ld\n",
-			result.best_candidate->i_ino);
-
-		int ret_unlink = ouichefs_unlink_inode(result.parent,
-						       result.best_candidate);
-		if (ret_unlink < 0) {
-			ret = ret_unlink;
-			goto end;
-		}
-
-		/* See fs.c for lengthy explanation */
-		d_prune_aliases(result.best_candidate);
-
-		iput(result.best_candidate);
-		iput(result.parent);
+	sb = dir->i_sb;
+	if (ouichefs_dir_full(dir)) {
+		ret = eviction_tracker_evict(dir, false, false, 0,
+					     EVICTION_TRIGGER_DIR_FULL,
+					     "parent directory full");
+		if (ret < 0)
+			return ret == -ENOENT ? -EMLINK : ret;
 	}
 
 	/* Get a new free inode */
 	inode = ouichefs_new_inode(dir, mode);
-	if (IS_ERR(inode)) {
-		ret = PTR_ERR(inode);
-		goto end;
-	}
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
 
 	/*
 	 * Scrub index_block for new file/directory to avoid previous data
 	 * messing with new file/directory.
 	 */
-	bh2 = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	bh2 = ouichefs_index_bh(inode);
 	if (!bh2) {
 		ret = -EIO;
 		goto iput;
 	}
 	fblock = (char *)bh2->b_data;
 	memset(fblock, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh2);
+	if (OUICHEFS_INODE(inode)->i_flags & OUICHEFS_IFLAG_EXTENTS)
+		ouichefs_extent_init_root(
+			(struct ouichefs_extent_block *)fblock);
+	if (S_ISDIR(mode))
+		ouichefs_dir_init_block(inode, fblock);
+	mark_buffer_dirty_inode(bh2, inode);
 	brelse(bh2);
 
-	/* Find first free slot in parent index and register new inode */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
-		if (dblock->files[i].inode == 0)
-			break;
-	dblock->files[i].inode = inode->i_ino;
-	strscpy(dblock->files[i].filename, dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh);
-	brelse(bh);
+	/* Register new inode in parent index */
+	ret = ouichefs_dir_add(dir, &dentry->d_name, inode->i_ino);
+	if (ret)
+		goto iput;
 
 	/* Update stats and mark dir and new inode dirty */
 	mark_inode_dirty(inode);
@@ -320,113 +363,238 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	/* setup dentry */
 	d_instantiate(dentry, inode);
 
+	eviction_tracker_index_insert(inode, dir, &dentry->d_name);
+
 	return 0;
 
 iput:
 	put_block(OUICHEFS_SB(sb), OUICHEFS_INODE(inode)->index_block);
 	put_inode(OUICHEFS_SB(sb), inode->i_ino);
 	iput(inode);
-end:
-	brelse(bh);
 	return ret;
 }
 
 /*
- * Remove a link for a file. If link count is 0, destroy file in this way:
- *   - remove the file from its parent directory.
+ * Scrub len blocks starting at bno as asked by scrub_mode, then give them back
+ * to the free bitmap. Always in this order: once freed, a block may be
+ * allocated and written by another file, and late zeroes or a late discard
+ * would destroy its data. If we fail to scrub a block, don't fail (too late
+ * anyway), just continue.
+ */
+void ouichefs_free_data_blocks(struct super_block *sb, uint32_t bno,
+			       uint32_t len)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	uint32_t i;
+
+	switch (READ_ONCE(scrub_mode)) {
+	case OUICHEFS_SCRUB_ZERO:
+		/* The blocks are overwritten, don't read them first */
+		for (i = 0; i < len; i++) {
+			bh = sb_getblk(sb, bno + i);
+			if (!bh)
+				continue;
+			lock_buffer(bh);
+			memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+			set_buffer_uptodate(bh);
+			unlock_buffer(bh);
+			mark_buffer_dirty(bh);
+			brelse(bh);
+		}
+		break;
+	case OUICHEFS_SCRUB_DISCARD:
+		/* One request for the whole run */
+		if (bdev_max_discard_sectors(sb->s_bdev))
+			sb_issue_discard(sb, bno, len, GFP_NOFS, 0);
+		break;
+	}
+
+	for (i = 0; i < len; i++)
+		put_block(sbi, bno + i);
+}
+
+/*
+ * Free the data blocks of a regular file of nr_blocks blocks (i_blocks) whose
+ * index block is file_block. The index block itself is left to the caller.
+ */
+static void ouichefs_release_data(struct super_block *sb, unsigned long ino,
+				  bool extents, void *file_block,
+				  uint32_t nr_blocks)
+{
+	struct ouichefs_file_index_block *index = file_block;
+	uint32_t blk, run = 0, len = 0;
+	int i;
+
+	if (extents) {
+		ouichefs_extent_release(sb, ino, file_block);
+		return;
+	}
+
+	/* Free physically contiguous blocks together */
+	for (i = 0; i < nr_blocks - 1 && i < OUICHEFS_BLOCK_SIZE >> 2; i++) {
+		blk = index->blocks[i];
+		if (blk && blk == run + len) {
+			len++;
+			continue;
+		}
+		if (len)
+			ouichefs_free_data_blocks(sb, run, len);
+		run = blk;
+		len = blk ? 1 : 0;
+	}
+	if (len)
+		ouichefs_free_data_blocks(sb, run, len);
+}
+
+/* A destroyed file whose blocks are released by the free worker */
+struct ouichefs_pending_free {
+	struct list_head list;
+	struct buffer_head *bh; /* Index block, we hold a reference */
+	unsigned long ino; /* For error messages */
+	uint32_t nr_blocks; /* i_blocks of the file */
+	bool extents;
+};
+
+/*
+ * Release the blocks of all files queued since the last run: data blocks,
+ * then the index block. The bitmaps of a frozen filesystem must not change, so
+ * the queued files are then left for the next run (see
+ * ouichefs_free_worker_flush()). The freeze waits for internal writes last,
+ * which lets the sync done by the freeze still release the blocks.
+ */
+static void ouichefs_free_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, free_work);
+	struct super_block *sb = sbi->sb;
+	struct ouichefs_pending_free *pf, *tmp;
+	struct blk_plug plug;
+	LIST_HEAD(batch);
+
+	if (!sb_start_intwrite_trylock(sb))
+		return;
+
+	spin_lock(&sbi->free_lock);
+	list_splice_init(&sbi->free_list, &batch);
+	spin_unlock(&sbi->free_lock);
+
+	/* Submit the scrubbing or discard I/O of the whole batch together */
+	blk_start_plug(&plug);
+	list_for_each_entry_safe(pf, tmp, &batch, list) {
+		ouichefs_release_data(sb, pf->ino, pf->extents, pf->bh->b_data,
+				      pf->nr_blocks);
+
+		/* Scrub index block */
+		memset(pf->bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+		mark_buffer_dirty(pf->bh);
+		put_block(sbi, pf->bh->b_blocknr);
+		brelse(pf->bh);
+
+		atomic_long_sub(pf->nr_blocks, &sbi->pending_free_blocks);
+		kfree(pf);
+		cond_resched();
+	}
+	blk_finish_plug(&plug);
+	sb_end_intwrite(sb);
+}
+
+void ouichefs_free_worker_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	INIT_LIST_HEAD(&sbi->free_list);
+	spin_lock_init(&sbi->free_lock);
+	atomic_long_set(&sbi->pending_free_blocks, 0);
+	INIT_WORK(&sbi->free_work, ouichefs_free_work);
+}
+
+/*
+ * Wait until the blocks of the files queued so far are released. The worker is
+ * always queued again: this catches files it skipped while the filesystem was
+ * frozen, and if it is running a batch, the new run only starts (and
+ * flush_work() only returns) once that batch is released.
+ */
+void ouichefs_free_worker_flush(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	queue_work(system_unbound_wq, &sbi->free_work);
+	flush_work(&sbi->free_work);
+}
+
+/*
+ * Queue the release of the blocks of a regular file to the free worker, which
+ * takes over our reference to its index block bh.
+ */
+static int ouichefs_queue_release(struct inode *inode, struct buffer_head *bh)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_pending_free *pf;
+
+	pf = kmalloc(sizeof(*pf), GFP_NOFS);
+	if (!pf)
+		return -ENOMEM;
+	pf->bh = bh;
+	pf->ino = inode->i_ino;
+	pf->nr_blocks = inode->i_blocks;
+	pf->extents = OUICHEFS_INODE(inode)->i_flags & OUICHEFS_IFLAG_EXTENTS;
+
+	atomic_long_add(pf->nr_blocks, &sbi->pending_free_blocks);
+	spin_lock(&sbi->free_lock);
+	list_add_tail(&pf->list, &sbi->free_list);
+	spin_unlock(&sbi->free_lock);
+	queue_work(system_unbound_wq, &sbi->free_work);
+
+	return 0;
+}
+
+/*
+ * Destroy a file whose last link was removed in this way:
  *   - cleanup blocks containing data
  *   - cleanup file index block
  *   - cleanup inode
+ * The blocks of regular files are released later by the free worker, so that
+ * the caller (which might be creating a file in an evicting directory) doesn't
+ * wait for the blocks of a big file to be scrubbed.
  */
-
-int ouichefs_unlink_inode(struct inode *dir, struct inode *inode)
+static void ouichefs_release_inode(struct inode *inode)
 {
-	struct super_block *sb = dir->i_sb;
+	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh = NULL, *bh2 = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh = NULL;
 	struct ouichefs_file_index_block *file_block = NULL;
 	uint32_t ino, bno;
-	int i, f_id = -1, nr_subs = 0;
 
 	ino = inode->i_ino;
 	bno = OUICHEFS_INODE(inode)->index_block;
 
-	/* Read parent directory index */
-	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
-	if (!bh)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh->b_data;
-
-	/* Search for inode in parent index and get number of subfiles */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		/* This is problematic:
-		 * We only check for inode ID not for the name
-		 * If a directory contains 2 hardlinks to the same inode
-		 * we will possibly remove the wrong one.
-		 * We'd need some check to see if the name matches
-		 * the dentry name
-		 * but we don't have access to the dentry here
-		 */
-		if (dir_block->files[i].inode == ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
-	}
-	nr_subs = i;
-
-	/* Remove file from parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh);
-	brelse(bh);
-
-	/* Update inode stats */
-	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
-	if (S_ISDIR(inode->i_mode))
-		inode_dec_link_count(dir);
-	mark_inode_dirty(dir);
-
-	/*
-	 * Only decrement link count if link count is 2 or more (hardlinks)
-	 * and return because no cleanup is necessary
-	 */
-	if (inode->i_nlink > 1) {
-		inode_dec_link_count(inode);
-		return 0;
-	}
+	/* Mappings cached by writeback are no longer valid */
+	WRITE_ONCE(ci->map_seq, ci->map_seq + 1);
 
 	/*
 	 * Cleanup pointed blocks if unlinking a file. If we fail to read the
 	 * index block, cleanup inode anyway and lose this file's blocks
-	 * forever. If we fail to scrub a data block, don't fail (too late
-	 * anyway), just put the block and continue.
+	 * forever.
 	 */
-	bh = sb_bread(sb, bno);
+	bh = ouichefs_index_bh(inode);
 	if (!bh)
 		goto clean_inode;
+	if (S_ISREG(inode->i_mode) && !ouichefs_queue_release(inode, bh)) {
+		/* The worker frees the index block too */
+		bno = 0;
+		goto clean_inode;
+	}
+
 	file_block = (struct ouichefs_file_index_block *)bh->b_data;
 	if (S_ISDIR(inode->i_mode))
-		goto scrub;
-	for (i = 0; i < inode->i_blocks - 1; i++) {
-		char *block;
-
-		if (!file_block->blocks[i])
-			continue;
-
-		put_block(sbi, file_block->blocks[i]);
-		bh2 = sb_bread(sb, file_block->blocks[i]);
-		if (!bh2)
-			continue;
-		block = (char *)bh2->b_data;
-		memset(block, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
-	}
+		ouichefs_dir_release(inode, file_block);
+	else
+		ouichefs_release_data(sb, ino,
+				      ci->i_flags & OUICHEFS_IFLAG_EXTENTS,
+				      file_block, inode->i_blocks);
 
-scrub:
 	/* Scrub index block */
 	memset(file_block, 0, OUICHEFS_BLOCK_SIZE);
 	mark_buffer_dirty(bh);
@@ -435,7 +603,8 @@ scrub:
 clean_inode:
 	/* Cleanup inode and mark dirty */
 	inode->i_blocks = 0;
-	OUICHEFS_INODE(inode)->index_block = 0;
+	ci->index_block = 0;
+	ci->i_flags = 0;
 	inode->i_size = 0;
 	i_uid_write(inode, 0);
 	i_gid_write(inode, 0);
@@ -446,30 +615,110 @@ clean_inode:
 	mark_inode_dirty(inode);
 
 	/* Free inode and index block from bitmap */
-	put_block(sbi, bno);
+	if (bno)
+		put_block(sbi, bno);
 	put_inode(sbi, ino);
+}
+
+/*
+ * Drop the links of the nr inodes that were removed from dir (bit k of found
+ * set for inodes[k]). For each file:
+ *   - update the parent directory
+ *   - if link count is 0, destroy the file (see ouichefs_release_inode())
+ */
+static void ouichefs_drop_links(struct inode *dir, struct inode **inodes,
+				int nr, unsigned long found)
+{
+	int k;
+
+	/* Update inode stats */
+	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
+	for (k = 0; k < nr; k++) {
+		if (!(found & BIT(k))) {
+			pr_err("inode %lu not found in directory %lu\n",
+			       inodes[k]->i_ino, dir->i_ino);
+			continue;
+		}
+		if (S_ISDIR(inodes[k]->i_mode))
+			inode_dec_link_count(dir);
+	}
+	mark_inode_dirty(dir);
+
+	for (k = 0; k < nr; k++) {
+		struct inode *inode = inodes[k];
+
+		if (!(found & BIT(k)))
+			continue;
+
+		eviction_tracker_index_unlink(inode, dir);
+		eviction_tracker_cache_forget(dir, inode);
+
+		/*
+		 * Only decrement link count if link count is 2 or more
+		 * (hardlinks) because no cleanup is necessary
+		 */
+		if (inode->i_nlink > 1)
+			inode_dec_link_count(inode);
+		else
+			ouichefs_release_inode(inode);
+	}
+}
+
+/*
+ * Remove a link for several files of the same directory, using their names if
+ * known (see ouichefs_dir_remove_inodes()). If link count is 0, destroy the
+ * file. Files that are not found in the directory are left untouched.
+ */
+int ouichefs_unlink_inodes(struct inode *dir, struct inode **inodes,
+			   const char **names, int nr)
+{
+	unsigned long found;
+	int ret;
+
+	if (WARN_ON(nr > BITS_PER_LONG))
+		return -EINVAL;
+	if (!nr)
+		return 0;
+
+	ret = ouichefs_dir_remove_inodes(dir, inodes, names, nr, &found);
+	if (ret)
+		return ret;
+
+	ouichefs_drop_links(dir, inodes, nr, found);
 
 	return 0;
 }
 
+/*
+ * Remove a link for a file. If link count is 0, destroy file.
+ */
+int ouichefs_unlink_inode(struct inode *dir, struct inode *inode)
+{
+	return ouichefs_unlink_inodes(dir, &inode, NULL, 1);
+}
+
 static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 {
 	struct inode *inode = d_inode(dentry);
+	int ret;
+
+	/* We know the name, so the right hardlink is removed */
+	ret = ouichefs_dir_remove(dir, &dentry->d_name, inode->i_ino);
+	if (ret)
+		return ret;
 
-	return ouichefs_unlink_inode(dir, inode);
+	ouichefs_drop_links(dir, &inode, 1, 1);
+
+	return 0;
 }
 
 static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 			   struct dentry *old_dentry, struct inode *new_dir,
 			   struct dentry *new_dentry, unsigned int flags)
 {
-	struct super_block *sb = old_dir->i_sb;
-	struct ouichefs_inode_info *ci_old = OUICHEFS_INODE(old_dir);
-	struct ouichefs_inode_info *ci_new = OUICHEFS_INODE(new_dir);
 	struct inode *src = d_inode(old_dentry);
-	struct buffer_head *bh_old = NULL, *bh_new = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
-	int i, f_id = -1, new_pos = -1, ret, nr_subs, f_pos = -1;
+	uint32_t ino;
+	int ret;
 
 	/* fail with these unsupported flags */
 	if (flags & (RENAME_EXCHANGE | RENAME_WHITEOUT))
@@ -479,75 +728,49 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	if (strlen(new_dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
 		return -ENAMETOOLONG;
 
-	/* Fail if new_dentry exists or if new_dir is full */
-	bh_new = sb_bread(sb, ci_new->index_block);
-	if (!bh_new)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_new->b_data;
-
-	/* Check if new_dir is full (and != old_dir) and evict if necessary */
-	if (new_dir != old_dir &&
-	    dir_block->files[OUICHEFS_MAX_SUBFILES - 1].inode != 0) {
-		struct eviction_tracker_scan_result result;
-
-		if (!eviction_tracker_get_inode_for_eviction(new_dir, false,
-							     &result)) {
-			ret = -EMLINK;
-			goto relse_new;
-		}
-
-		int ret_unlink = ouichefs_unlink_inode(result.parent,
-						       result.best_candidate);
-		if (ret_unlink < 0) {
-			ret = ret_unlink;
-			goto relse_new;
-		}
-
-		/* See fs.c for lengthy explanation */
-		d_prune_aliases(result.best_candidate);
-
-		iput(result.best_candidate);
-		iput(result.parent);
-	}
+	/* Fail if new_dentry exists */
+	ret = ouichefs_dir_lookup(new_dir, &new_dentry->d_name, &ino);
+	if (!ret)
+		return -EEXIST;
+	if (ret != -ENOENT)
+		return ret;
 
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		/* if old_dir == new_dir, save the renamed file position */
-		if (new_dir == old_dir) {
-			if (strncmp(dir_block->files[i].filename,
-				    old_dentry->d_name.name,
-				    OUICHEFS_FILENAME_LEN) == 0)
-				f_pos = i;
-		}
-		if (strncmp(dir_block->files[i].filename,
-			    new_dentry->d_name.name,
-			    OUICHEFS_FILENAME_LEN) == 0) {
-			ret = -EEXIST;
-			goto relse_new;
-		}
-		if (new_pos < 0 && dir_block->files[i].inode == 0)
-			new_pos = i;
-	}
-	/* if old_dir == new_dir, just rename entry */
+	/*
+	 * if old_dir == new_dir, just rename entry. In a hashed directory the
+	 * entry may move to a new bucket block, which changes the size too.
+	 */
 	if (old_dir == new_dir) {
-		strscpy(dir_block->files[f_pos].filename,
-			new_dentry->d_name.name, OUICHEFS_FILENAME_LEN);
-		mark_buffer_dirty(bh_new);
-		ret = 0;
-		goto relse_new;
+		ret = ouichefs_dir_rename(old_dir, &old_dentry->d_name,
+					  &new_dentry->d_name, src->i_ino);
+		if (ret)
+			return ret;
+
+		eviction_tracker_index_move(src, old_dir, old_dir,
+					    &new_dentry->d_name);
+		eviction_tracker_cache_forget(old_dir, src);
+
+		old_dir->i_atime = old_dir->i_ctime = old_dir->i_mtime =
+			current_time(old_dir);
+		mark_inode_dirty(old_dir);
+		return 0;
 	}
 
-	/* If new directory is empty, fail */
-	if (new_pos < 0) {
-		ret = -EMLINK;
-		goto relse_new;
+	/* Check if new_dir is full and evict if necessary */
+	if (ouichefs_dir_full(new_dir)) {
+		ret = eviction_tracker_evict(new_dir, false, false, 0,
+					     EVICTION_TRIGGER_DIR_FULL,
+					     "target directory full");
+		if (ret < 0)
+			return ret == -ENOENT ? -EMLINK : ret;
 	}
 
 	/* insert in new parent directory */
-	dir_block->files[new_pos].inode = src->i_ino;
-	strscpy(dir_block->files[new_pos].filename, new_dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh_new);
-	brelse(bh_new);
+	ret = ouichefs_dir_add(new_dir, &new_dentry->d_name, src->i_ino);
+	if (ret)
+		return ret;
+
+	eviction_tracker_index_move(src, old_dir, new_dir, &new_dentry->d_name);
+	eviction_tracker_cache_forget(old_dir, src);
 
 	/* Update new parent inode metadata */
 	new_dir->i_atime = new_dir->i_ctime = new_dir->i_mtime =
@@ -557,26 +780,9 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	mark_inode_dirty(new_dir);
 
 	/* remove target from old parent directory */
-	bh_old = sb_bread(sb, ci_old->index_block);
-	if (!bh_old)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_old->b_data;
-	/* Search for inode in old directory and number of subfiles */
-	for (i = 0; OUICHEFS_MAX_SUBFILES; i++) {
-		if (dir_block->files[i].inode == src->i_ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
-	}
-	nr_subs = i;
-
-	/* Remove file from old parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh_old);
-	brelse(bh_old);
+	ret = ouichefs_dir_remove(old_dir, &old_dentry->d_name, src->i_ino);
+	if (ret)
+		return ret;
 
 	/* Update old parent inode metadata */
 	old_dir->i_atime = old_dir->i_ctime = old_dir->i_mtime =
@@ -586,10 +792,6 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	mark_inode_dirty(old_dir);
 
 	return 0;
-
-relse_new:
-	brelse(bh_new);
-	return ret;
 }
 
 static int ouichefs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
@@ -600,23 +802,17 @@ static int ouichefs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 
 static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
 {
-	struct super_block *sb = dir->i_sb;
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh;
-	struct ouichefs_dir_block *dblock;
+	int nr;
 
 	/* If the directory is not empty, fail */
 	if (inode->i_nlink > 2)
 		return -ENOTEMPTY;
-	bh = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-	if (dblock->files[0].inode != 0) {
-		brelse(bh);
+	nr = ouichefs_dir_nr_entries(inode);
+	if (nr < 0)
+		return nr;
+	if (nr)
 		return -ENOTEMPTY;
-	}
-	brelse(bh);
 
 	/* Remove directory with unlink */
 	return ouichefs_unlink(dir, dentry);
@@ -653,7 +849,7 @@ static int ouichefs_symlink(struct mnt_idmap *idmap, struct inode *dir,
 
 	/* Write the symname into the file block */
 	strncpy(bh->b_data, symname, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh);
+	mark_buffer_dirty_inode(bh, inode);
 	brelse(bh);
 
 	inode->i_size = strlen(symname);
@@ -709,52 +905,23 @@ static int ouichefs_link(struct dentry *old_dentry, struct inode *dir,
 
 	struct inode *inode = d_inode(old_dentry);
 
-	struct super_block *sb = dir->i_sb;
-	struct ouichefs_inode_info *ci_dir = OUICHEFS_INODE(dir);
-	struct buffer_head *bh = sb_bread(sb, ci_dir->index_block);
-
-	if (!bh)
-		return -EIO;
-
-	struct ouichefs_dir_block *dblock =
-		(struct ouichefs_dir_block *)bh->b_data;
-
 	/* If target directory is full, evict an inode */
-	if (dblock->files[OUICHEFS_MAX_SUBFILES - 1].inode != 0) {
-		struct eviction_tracker_scan_result result;
-
-		if (!eviction_tracker_get_inode_for_eviction(dir, false,
-							     &result)) {
-			dput(dentry);
-			return -EMLINK;
-		}
-
-		int ret_unlink = ouichefs_unlink_inode(result.parent,
-						       result.best_candidate);
-		if (ret_unlink < 0) {
+	if (ouichefs_dir_full(dir)) {
+		ret = eviction_tracker_evict(dir, false, false, 0,
+					     EVICTION_TRIGGER_DIR_FULL,
+					     "target directory full");
+		if (ret < 0) {
 			dput(dentry);
-			return ret_unlink;
+			return ret == -ENOENT ? -EMLINK : ret;
 		}
-
-		/* See fs.c for lengthy explanation */
-		d_prune_aliases(result.best_candidate);
-
-		iput(result.best_candidate);
-		iput(result.parent);
 	}
 
-	/* Find first free slot in parent index and register new inode */
-	int i;
-
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		if (dblock->files[i].inode == 0)
-			break;
+	/* Register the inode in parent index */
+	ret = ouichefs_dir_add(dir, &dentry->d_name, inode->i_ino);
+	if (ret) {
+		dput(dentry);
+		return ret;
 	}
-	dblock->files[i].inode = inode->i_ino;
-	strscpy(dblock->files[i].filename, dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh);
-	brelse(bh);
 
 	/* Update stats and mark dir and new inode dirty */
 	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
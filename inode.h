@@ -1,5 +1,16 @@
 #ifndef _INODE_H
 #define _INODE_H
+struct buffer_head *ouichefs_index_bh(struct inode *inode);
 int ouichefs_unlink_inode(struct inode *dir, struct inode *inode);
+int ouichefs_unlink_inodes(struct inode *dir, struct inode **inodes,
+			   const char **names, int nr);
+
+/* enum ouichefs_scrub_mode, what to do with the blocks of destroyed files */
+extern int scrub_mode;
+
+void ouichefs_free_data_blocks(struct super_block *sb, uint32_t bno,
+			       uint32_t len);
+void ouichefs_free_worker_init(struct super_block *sb);
+void ouichefs_free_worker_flush(struct super_block *sb);
 
 #endif
@@ -18,6 +18,13 @@
 #define OUICHEFS_FILENAME_LEN 28
 #define OUICHEFS_MAX_SUBFILES 128
 
+/* Superblock feature flags */
+#define OUICHEFS_FEATURE_EXTENTS 0x1 /* New files use an extent tree */
+#define OUICHEFS_FEATURE_HASHED_DIRS 0x2 /* New directories are hashed */
+
+/* Inode flags, stored in the upper half of i_mode */
+#define OUICHEFS_IFLAG_HASHED 0x00020000 /* Index block is a hash root */
+
 struct ouichefs_inode {
 	mode_t i_mode; /* File mode */
 	uint32_t i_uid; /* Owner id */
@@ -47,7 +54,9 @@ struct ouichefs_superblock {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	char padding[4064]; /* Padding to match block size */
+	uint32_t features; /* OUICHEFS_FEATURE_* */
+
+	char padding[4060]; /* Padding to match block size */
 };
 
 struct ouichefs_file_index_block {
@@ -61,11 +70,23 @@ struct ouichefs_dir_block {
 	} files[OUICHEFS_MAX_SUBFILES];
 };
 
+#define OUICHEFS_DIR_HASH_MAGIC 0x48534944 /* "DISH" */
+#define OUICHEFS_DIR_BUCKETS ((OUICHEFS_BLOCK_SIZE >> 2) - 3)
+
+struct ouichefs_dir_hash_root {
+	uint32_t magic;
+	uint32_t nr_entries;
+	uint32_t reserved;
+	uint32_t buckets[OUICHEFS_DIR_BUCKETS];
+};
+
 static inline void usage(char *appname)
 {
 	fprintf(stderr,
 		"Usage:\n"
-		"%s disk\n",
+		"%s [-e] [-d] disk\n"
+		"\t-e\tstore new files in extent trees (files up to 4 GiB)\n"
+		"\t-d\tuse hashed directories (more than 128 files)\n",
 		appname);
 }
 
@@ -78,7 +99,8 @@ static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 	return ret;
 }
 
-static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
+static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats,
+						    uint32_t features)
 {
 	int ret;
 	struct ouichefs_superblock *sb;
@@ -110,6 +132,7 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
 	sb->nr_free_inodes = htole32(nr_inodes - 1);
 	sb->nr_free_blocks = htole32(nr_data_blocks - 1);
+	sb->features = htole32(features);
 
 	ret = write(fd, sb, sizeof(struct ouichefs_superblock));
 	if (ret != sizeof(struct ouichefs_superblock)) {
@@ -124,10 +147,12 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
-	       "\tnr_free_blocks=%u\n",
+	       "\tnr_free_blocks=%u\n"
+	       "\tfeatures=%#x\n",
 	       sizeof(struct ouichefs_superblock), sb->magic, sb->nr_blocks,
 	       sb->nr_inodes, sb->nr_istore_blocks, sb->nr_ifree_blocks,
-	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks);
+	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks,
+	       sb->features);
 
 	return sb;
 }
@@ -154,6 +179,8 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	inode->i_mode =
 		htole32(S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
 			S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
+	if (le32toh(sb->features) & OUICHEFS_FEATURE_HASHED_DIRS)
+		inode->i_mode |= htole32(OUICHEFS_IFLAG_HASHED);
 	inode->i_uid = 0;
 	inode->i_gid = 0;
 	inode->i_size = htole32(OUICHEFS_BLOCK_SIZE);
@@ -289,37 +316,62 @@ end:
 static int write_data_blocks(int fd, struct ouichefs_superblock *sb)
 {
 	int ret = 0;
-	/* struct ouichefs_dir_block root_block; */
-	/* struct ouichefs_file_index_block foo_block; */
-	/* char *foo; */
-	/* uint32_t first_block = le32toh(sb->nr_istore_blocks) + */
-	/* 	le32toh(sb->nr_ifree_blocks) + le32toh(sb->nr_bfree_blocks) + 3; */
+	struct ouichefs_dir_hash_root *root;
 
-	/* foo = malloc(OUICHEFS_BLOCK_SIZE); */
-	/* if (!foo) */
-	/* 	return -1; */
-	/* memset(foo, 0, OUICHEFS_BLOCK_SIZE); */
+	/* A legacy root directory block is all zeroes, nothing to write */
+	if (!(le32toh(sb->features) & OUICHEFS_FEATURE_HASHED_DIRS))
+		return 0;
 
-	/* end: */
-	/* 	free(foo); */
+	/* Root directory index block (first data block) */
+	root = malloc(OUICHEFS_BLOCK_SIZE);
+	if (!root)
+		return -1;
+	memset(root, 0, OUICHEFS_BLOCK_SIZE);
+	root->magic = htole32(OUICHEFS_DIR_HASH_MAGIC);
+
+	ret = write(fd, root, OUICHEFS_BLOCK_SIZE);
+	if (ret != OUICHEFS_BLOCK_SIZE) {
+		ret = -1;
+		goto end;
+	}
+	ret = 0;
+
+	printf("Data blocks: wrote hashed root directory\n");
+
+end:
+	free(root);
 
 	return ret;
 }
 
 int main(int argc, char **argv)
 {
-	int ret = EXIT_SUCCESS, fd;
+	int ret = EXIT_SUCCESS, fd, opt;
 	long int min_size;
 	struct stat stat_buf;
 	struct ouichefs_superblock *sb = NULL;
-
-	if (argc != 2) {
+	uint32_t features = 0;
+
+	while ((opt = getopt(argc, argv, "ed")) != -1) {
+		switch (opt) {
+		case 'e':
+			features |= OUICHEFS_FEATURE_EXTENTS;
+			break;
+		case 'd':
+			features |= OUICHEFS_FEATURE_HASHED_DIRS;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
 	/* Open disk image */
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("open():");
 		return EXIT_FAILURE;
@@ -344,7 +396,7 @@ int main(int argc, char **argv)
 	}
 
 	/* Write superblock (block 0) */
-	sb = write_superblock(fd, &stat_buf);
+	sb = write_superblock(fd, &stat_buf, features);
 	if (!sb) {
 		perror("write_superblock():");
 		ret = EXIT_FAILURE;
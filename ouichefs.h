@@ -8,16 +8,27 @@
 #define _OUICHEFS_H
 
 #include <linux/fs.h>
+#include <linux/rbtree.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/percpu_counter.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
 #define OUICHEFS_SB_BLOCK_NR 0
 
 #define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
+#define OUICHEFS_BITS_PER_BLOCK (OUICHEFS_BLOCK_SIZE * 8) /* Bitmap blocks */
 #define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
+#define OUICHEFS_MAX_EXTENT_FILESIZE ((4LL << 30) - 1) /* i_size is 32 bits */
 #define OUICHEFS_FILENAME_LEN 28
 #define OUICHEFS_MAX_SUBFILES 128
 
+/* Needs OUICHEFS_FILENAME_LEN */
+#include "eviction_tracker.h"
+
 /*
  * ouiche_fs partition layout
  *
@@ -36,6 +47,31 @@
  *
  */
 
+/* Superblock feature flags */
+#define OUICHEFS_FEATURE_EXTENTS 0x1 /* New files use an extent tree */
+#define OUICHEFS_FEATURE_HASHED_DIRS 0x2 /* New directories are hashed */
+#define OUICHEFS_FEATURES_SUPPORTED \
+	(OUICHEFS_FEATURE_EXTENTS | OUICHEFS_FEATURE_HASHED_DIRS)
+
+/*
+ * Inode flags, stored in the upper half of the on-disk i_mode (the VFS mode
+ * only uses the lower 16 bits)
+ */
+#define OUICHEFS_IFLAG_EXTENTS 0x00010000 /* Index block is an extent root */
+#define OUICHEFS_IFLAG_HASHED 0x00020000 /* Index block is a hash root */
+#define OUICHEFS_IFLAGS_MASK 0xffff0000
+
+/*
+ * What happens to the data blocks of a destroyed file (scrub_mode parameter).
+ * New blocks are always zeroed when they are allocated to a file, so scrubbing
+ * only makes sure old data doesn't stay on the device.
+ */
+enum ouichefs_scrub_mode {
+	OUICHEFS_SCRUB_ZERO, /* Overwrite them with zeroes */
+	OUICHEFS_SCRUB_DISCARD, /* Discard them if the device supports it */
+	OUICHEFS_SCRUB_NONE, /* Leave them as they are */
+};
+
 struct ouichefs_inode {
 	uint32_t i_mode; /* File mode */
 	uint32_t i_uid; /* Owner id */
@@ -51,12 +87,52 @@ struct ouichefs_inode {
 
 struct ouichefs_inode_info {
 	uint32_t index_block;
+	struct buffer_head *index_bh; /* Pinned index block, NULL if not read */
+	uint32_t i_flags; /* OUICHEFS_IFLAG_* */
+	struct mutex map_mutex; /* Protects the extent tree */
+	unsigned int map_seq; /* Bumped when mapped blocks are freed */
+	/* Best eviction candidates of a directory, NULL until needed */
+	struct eviction_tracker_victim_cache *victim_cache;
+	/* Score of the file in the eviction index generation eviction_gen */
+	u64 eviction_score;
+	unsigned int eviction_gen; /* 0 if the score is not known */
 	struct inode vfs_inode;
 };
 
 #define OUICHEFS_INODES_PER_BLOCK \
 	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
 
+/*
+ * The inode and block bitmaps are split in allocation groups of
+ * OUICHEFS_GROUP_BITS bits. Each group counts its free bits and remembers
+ * where its last allocation ended, in its own cache line so that CPUs
+ * allocating from different groups don't write to the same cache lines.
+ */
+#define OUICHEFS_GROUP_BITS 4096
+#define OUICHEFS_GROUPS_PER_CHUNK \
+	(OUICHEFS_BITS_PER_BLOCK / OUICHEFS_GROUP_BITS)
+
+struct ouichefs_group {
+	atomic_t nr_free; /* Number of free bits */
+	uint32_t hint; /* Where the next allocation starts in the group */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * In-memory copy of an on-disk free bitmap (a set bit is free), read one
+ * bitmap block (chunk) at a time when it is first needed (see bitmap.c).
+ */
+struct ouichefs_bitmap {
+	uint32_t size; /* Number of bits */
+	uint32_t first_block; /* First on-disk block of the bitmap */
+	uint32_t nr_chunks; /* Number of on-disk blocks */
+	uint32_t nr_groups;
+	unsigned long **chunks; /* One per on-disk block, NULL until read */
+	unsigned long *dirty; /* One bit per chunk changed since last sync */
+	struct ouichefs_group *groups;
+	struct mutex load_mutex; /* Serializes chunk reads */
+	struct mutex sync_mutex; /* Serializes write backs */
+};
+
 struct ouichefs_sb_info {
 	uint32_t magic; /* Magic number */
 
@@ -67,17 +143,82 @@ struct ouichefs_sb_info {
 	uint32_t nr_ifree_blocks; /* Number of inode free bitmap blocks */
 	uint32_t nr_bfree_blocks; /* Number of block free bitmap blocks */
 
+	/* On disk only, see free_inodes and free_blocks */
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
-	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+	uint32_t features; /* OUICHEFS_FEATURE_* */
+
+	struct ouichefs_bitmap ifree; /* Free inodes bitmap */
+	struct ouichefs_bitmap bfree; /* Free blocks bitmap */
+	atomic_long_t bitmap_flushed; /* Bitmap blocks written by sync */
+	atomic_long_t bitmap_skipped; /* Clean bitmap blocks not written */
+	struct eviction_tracker_stats eviction_stats;
+	/* Number of free inodes/blocks, exact only when summed */
+	struct percpu_counter free_inodes;
+	struct percpu_counter free_blocks;
+
+	struct super_block *sb; /* Back pointer for the eviction worker */
+	struct eviction_tracker_index eviction_index; /* Files by priority */
+	struct mutex eviction_mutex; /* Serializes evictions */
+	struct work_struct eviction_work; /* Background eviction */
+	bool eviction_stopped; /* Set on unmount, no more background work */
+
+	/* Destroyed files whose blocks are released in the background */
+	struct list_head free_list;
+	spinlock_t free_lock; /* Protects free_list */
+	struct work_struct free_work;
+	atomic_long_t pending_free_blocks; /* Blocks of the queued files */
+
+	struct kobject kobj; /* /sys/kernel/ouichefs/<device>/ */
+	struct completion kobj_unregister; /* Released when kobj is */
+	bool kobj_registered;
 };
 
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
 
+/*
+ * Index block of a file with OUICHEFS_IFLAG_EXTENTS: the root of an extent
+ * tree of depth 0 (the root holds the extents) or 1 (the root holds index
+ * entries pointing to leaf blocks holding the extents). Extents and index
+ * entries are sorted by logical block.
+ */
+#define OUICHEFS_EXTENT_MAGIC 0x54584545 /* "EEXT" */
+
+struct ouichefs_extent_header {
+	uint32_t magic; /* OUICHEFS_EXTENT_MAGIC */
+	uint16_t nr_entries; /* Number of used entries */
+	uint16_t depth; /* 0 for leaves, 1 for a root with index entries */
+};
+
+struct ouichefs_extent {
+	uint32_t ee_block; /* First logical block */
+	uint32_t ee_start; /* First physical block */
+	uint32_t ee_len; /* Number of blocks */
+};
+
+struct ouichefs_extent_idx {
+	uint32_t ei_block; /* First logical block covered by the leaf */
+	uint32_t ei_leaf; /* Leaf block */
+};
+
+#define OUICHEFS_EXTENTS_PER_BLOCK                                   \
+	((OUICHEFS_BLOCK_SIZE - sizeof(struct ouichefs_extent_header)) / \
+	 sizeof(struct ouichefs_extent))
+#define OUICHEFS_EXTENT_IDX_PER_BLOCK                                \
+	((OUICHEFS_BLOCK_SIZE - sizeof(struct ouichefs_extent_header)) / \
+	 sizeof(struct ouichefs_extent_idx))
+
+struct ouichefs_extent_block {
+	struct ouichefs_extent_header header;
+	union {
+		struct ouichefs_extent extents[OUICHEFS_EXTENTS_PER_BLOCK];
+		struct ouichefs_extent_idx idx[OUICHEFS_EXTENT_IDX_PER_BLOCK];
+	};
+};
+
 struct ouichefs_dir_block {
 	struct ouichefs_file {
 		uint32_t inode;
@@ -85,6 +226,30 @@ struct ouichefs_dir_block {
 	} files[OUICHEFS_MAX_SUBFILES];
 };
 
+/*
+ * Index block of a directory with OUICHEFS_IFLAG_HASHED: files are spread
+ * over a fixed number of buckets by the hash of their name. Each bucket is a
+ * chain of blocks, allocated when the previous ones are full.
+ */
+#define OUICHEFS_DIR_HASH_MAGIC 0x48534944 /* "DISH" */
+#define OUICHEFS_DIR_BUCKETS ((OUICHEFS_BLOCK_SIZE >> 2) - 3)
+
+struct ouichefs_dir_hash_root {
+	uint32_t magic; /* OUICHEFS_DIR_HASH_MAGIC */
+	uint32_t nr_entries; /* Number of files in the directory */
+	uint32_t reserved;
+	uint32_t buckets[OUICHEFS_DIR_BUCKETS]; /* First block of each chain */
+};
+
+#define OUICHEFS_BUCKET_FILES (OUICHEFS_MAX_SUBFILES - 1)
+
+struct ouichefs_dir_bucket {
+	uint32_t next; /* Next block of the chain, 0 for the last one */
+	uint32_t nr_entries; /* Number of used entries */
+	char padding[sizeof(struct ouichefs_file) - 8];
+	struct ouichefs_file files[OUICHEFS_BUCKET_FILES];
+};
+
 /* superblock functions */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 
@@ -92,15 +257,27 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 int ouichefs_init_inode_cache(void);
 void ouichefs_destroy_inode_cache(void);
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino);
+int ouichefs_read_inode_attrs(struct super_block *sb, unsigned long ino,
+			      struct eviction_candidate_attrs *attrs);
 
 /* file functions */
 extern const struct file_operations ouichefs_file_ops;
 extern const struct file_operations ouichefs_dir_ops;
 extern const struct address_space_operations ouichefs_aops;
+extern const struct inode_operations ouichefs_file_inode_ops;
+int ouichefs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 
 /* Getters for superbock and inode */
 #define OUICHEFS_SB(sb) (sb->s_fs_info)
 #define OUICHEFS_INODE(inode) \
 	(container_of(inode, struct ouichefs_inode_info, vfs_inode))
 
+/* Files with an extent tree can grow beyond the legacy 4 MiB */
+static inline loff_t ouichefs_max_filesize(struct inode *inode)
+{
+	if (OUICHEFS_INODE(inode)->i_flags & OUICHEFS_IFLAG_EXTENTS)
+		return OUICHEFS_MAX_EXTENT_FILESIZE;
+	return OUICHEFS_MAX_FILESIZE;
+}
+
 #endif /* _OUICHEFS_H */
@@ -14,6 +14,8 @@
 #include <linux/statfs.h>
 
 #include "ouichefs.h"
+#include "bitmap.h"
+#include "sysfs.h"
 
 static struct kmem_cache *ouichefs_inode_cache;
 
@@ -41,17 +43,52 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	if (!ci)
 		return NULL;
 	inode_init_once(&ci->vfs_inode);
+	ci->index_bh = NULL;
+	ci->map_seq = 0;
+	mutex_init(&ci->map_mutex);
+	ci->victim_cache = NULL;
+	ci->eviction_gen = 0;
 	return &ci->vfs_inode;
 }
 
+/*
+ * Called by the VFS when the inode is removed from memory, unpin its index
+ * block and forget the metadata blocks attached for fsync. An unlinked file
+ * can still have been indexed by a scan that found it before the unlink.
+ */
+static void ouichefs_evict_inode(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	if (!inode->i_nlink)
+		eviction_tracker_index_forget(inode);
+
+	truncate_inode_pages_final(&inode->i_data);
+	/* Metadata blocks stay dirty in the buffer cache, only for fsync */
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
+	brelse(ci->index_bh);
+	ci->index_bh = NULL;
+}
+
 static void ouichefs_destroy_inode(struct inode *inode)
 {
 	struct ouichefs_inode_info *ci;
 
 	ci = OUICHEFS_INODE(inode);
+	kfree(ci->victim_cache);
 	kmem_cache_free(ouichefs_inode_cache, ci);
 }
 
+/*
+ * Called by the VFS whenever an inode is dirtied (e.g. atime, mtime or size
+ * update), keep the eviction index sorted.
+ */
+static void ouichefs_dirty_inode(struct inode *inode, int flags)
+{
+	eviction_tracker_index_update(inode, EVICTION_EVENT_ATTRS);
+}
+
 static int ouichefs_write_inode(struct inode *inode,
 				struct writeback_control *wbc)
 {
@@ -63,6 +100,7 @@ static int ouichefs_write_inode(struct inode *inode,
 	uint32_t ino = inode->i_ino;
 	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
 	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	int ret = 0;
 
 	if (ino >= sbi->nr_inodes)
 		return 0;
@@ -74,7 +112,7 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_inode += inode_shift;
 
 	/* update the mode using what the generic inode has */
-	disk_inode->i_mode = inode->i_mode;
+	disk_inode->i_mode = inode->i_mode | ci->i_flags;
 	disk_inode->i_uid = i_uid_read(inode);
 	disk_inode->i_gid = i_gid_read(inode);
 	disk_inode->i_size = inode->i_size;
@@ -85,11 +123,30 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_inode->i_nlink = inode->i_nlink;
 	disk_inode->index_block = ci->index_block;
 
+	/*
+	 * Unless the caller waits for the inode to be on disk (fsync, sync),
+	 * leave the inode store block dirty: the inodes sharing it are then
+	 * written together by the block device writeback.
+	 */
 	mark_buffer_dirty(bh);
+	if (wbc->sync_mode != WB_SYNC_ALL)
+		goto release;
+
 	sync_dirty_buffer(bh);
+	if (buffer_req(bh) && !buffer_uptodate(bh))
+		ret = -EIO;
+
+	/* Changes to the pinned index block are written back with the inode */
+	if (ci->index_bh && buffer_dirty(ci->index_bh)) {
+		sync_dirty_buffer(ci->index_bh);
+		if (!buffer_uptodate(ci->index_bh))
+			ret = -EIO;
+	}
+
+release:
 	brelse(bh);
 
-	return 0;
+	return ret;
 }
 
 static int sync_sb_info(struct super_block *sb, int wait)
@@ -109,8 +166,11 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
 	disk_sb->nr_ifree_blocks = sbi->nr_ifree_blocks;
 	disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
-	disk_sb->nr_free_inodes = sbi->nr_free_inodes;
-	disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+	disk_sb->nr_free_inodes =
+		percpu_counter_sum_positive(&sbi->free_inodes);
+	disk_sb->nr_free_blocks =
+		percpu_counter_sum_positive(&sbi->free_blocks);
+	disk_sb->features = sbi->features;
 
 	mark_buffer_dirty(bh);
 	if (wait)
@@ -123,55 +183,17 @@ static int sync_sb_info(struct super_block *sb, int wait)
 static int sync_ifree(struct super_block *sb, int wait)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh;
-	int i, idx;
 
 	/* Flush free inodes bitmask */
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh)
-			return -EIO;
-
-		memcpy(bh->b_data,
-		       (void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
-
-		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
-		brelse(bh);
-	}
-
-	return 0;
+	return ouichefs_bitmap_sync(sb, &sbi->ifree, wait);
 }
 
 static int sync_bfree(struct super_block *sb, int wait)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh;
-	int i, idx;
 
 	/* Flush free blocks bitmask */
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh)
-			return -EIO;
-
-		memcpy(bh->b_data,
-		       (void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
-
-		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
-		brelse(bh);
-	}
-
-	return 0;
+	return ouichefs_bitmap_sync(sb, &sbi->bfree, wait);
 }
 
 static void ouichefs_put_super(struct super_block *sb)
@@ -179,8 +201,11 @@ static void ouichefs_put_super(struct super_block *sb)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	if (sbi) {
-		kfree(sbi->ifree_bitmap);
-		kfree(sbi->bfree_bitmap);
+		ouichefs_sysfs_unregister(sb);
+		ouichefs_bitmap_destroy(&sbi->ifree);
+		ouichefs_bitmap_destroy(&sbi->bfree);
+		percpu_counter_destroy(&sbi->free_blocks);
+		percpu_counter_destroy(&sbi->free_inodes);
 		kfree(sbi);
 	}
 }
@@ -189,6 +214,10 @@ static int ouichefs_sync_fs(struct super_block *sb, int wait)
 {
 	int ret = 0;
 
+	/* Let the blocks of destroyed files reach the bitmap first */
+	if (wait)
+		ouichefs_free_worker_flush(sb);
+
 	ret = sync_sb_info(sb, wait);
 	if (ret)
 		return ret;
@@ -210,10 +239,10 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	stat->f_type = OUICHEFS_MAGIC;
 	stat->f_bsize = OUICHEFS_BLOCK_SIZE;
 	stat->f_blocks = sbi->nr_blocks;
-	stat->f_bfree = sbi->nr_free_blocks;
-	stat->f_bavail = sbi->nr_free_blocks;
+	stat->f_bfree = percpu_counter_sum_positive(&sbi->free_blocks);
+	stat->f_bavail = stat->f_bfree;
 	stat->f_files = sbi->nr_inodes;
-	stat->f_ffree = sbi->nr_free_inodes;
+	stat->f_ffree = percpu_counter_sum_positive(&sbi->free_inodes);
 	stat->f_namelen = OUICHEFS_FILENAME_LEN;
 
 	return 0;
@@ -223,6 +252,8 @@ static struct super_operations ouichefs_super_ops = {
 	.put_super = ouichefs_put_super,
 	.alloc_inode = ouichefs_alloc_inode,
 	.destroy_inode = ouichefs_destroy_inode,
+	.evict_inode = ouichefs_evict_inode,
+	.dirty_inode = ouichefs_dirty_inode,
 	.write_inode = ouichefs_write_inode,
 	.sync_fs = ouichefs_sync_fs,
 	.statfs = ouichefs_statfs,
@@ -235,7 +266,7 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	struct ouichefs_sb_info *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
 	struct inode *root_inode = NULL;
-	int ret = 0, i;
+	int ret = 0;
 
 	/* Init sb */
 	sb->s_magic = OUICHEFS_MAGIC;
@@ -256,6 +287,14 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto release;
 	}
 
+	/* Refuse to mount a partition using features we don't know */
+	if (csb->features & ~OUICHEFS_FEATURES_SUPPORTED) {
+		pr_err("Unsupported features 0x%x\n",
+		       csb->features & ~OUICHEFS_FEATURES_SUPPORTED);
+		ret = -EINVAL;
+		goto release;
+	}
+
 	/* Alloc sb_info */
 	sbi = kzalloc(sizeof(struct ouichefs_sb_info), GFP_KERNEL);
 	if (!sbi) {
@@ -267,55 +306,38 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->nr_istore_blocks = csb->nr_istore_blocks;
 	sbi->nr_ifree_blocks = csb->nr_ifree_blocks;
 	sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
-	sbi->nr_free_inodes = csb->nr_free_inodes;
-	sbi->nr_free_blocks = csb->nr_free_blocks;
+	sbi->features = csb->features;
+	sbi->sb = sb;
+	mutex_init(&sbi->eviction_mutex);
 	sb->s_fs_info = sbi;
 
-	brelse(bh);
-
-	/* Alloc and copy ifree_bitmap */
-	sbi->ifree_bitmap =
-		kzalloc(sbi->nr_ifree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-	if (!sbi->ifree_bitmap) {
-		ret = -ENOMEM;
-		goto free_sbi;
-	}
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_ifree;
-		}
+	ret = percpu_counter_init(&sbi->free_inodes, csb->nr_free_inodes,
+				  GFP_KERNEL);
+	if (!ret)
+		ret = percpu_counter_init(&sbi->free_blocks,
+					  csb->nr_free_blocks, GFP_KERNEL);
+	if (ret)
+		goto free_counters;
 
-		memcpy((void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+	brelse(bh);
+	bh = NULL;
 
-		brelse(bh);
-	}
+	/* Files with an extent tree are not limited to a single index block */
+	if (sbi->features & OUICHEFS_FEATURE_EXTENTS)
+		sb->s_maxbytes = OUICHEFS_MAX_EXTENT_FILESIZE;
 
-	/* Alloc and copy bfree_bitmap */
-	sbi->bfree_bitmap =
-		kzalloc(sbi->nr_bfree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-	if (!sbi->bfree_bitmap) {
-		ret = -ENOMEM;
+	/* The bitmaps are read chunk by chunk when first used */
+	ret = ouichefs_bitmap_init(&sbi->ifree, sbi->nr_inodes,
+				   sbi->nr_istore_blocks + 1,
+				   sbi->nr_ifree_blocks);
+	if (ret)
+		goto free_counters;
+	ret = ouichefs_bitmap_init(&sbi->bfree, sbi->nr_blocks,
+				   sbi->nr_istore_blocks +
+					   sbi->nr_ifree_blocks + 1,
+				   sbi->nr_bfree_blocks);
+	if (ret)
 		goto free_ifree;
-	}
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_bfree;
-		}
-
-		memcpy((void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
-
-		brelse(bh);
-	}
 
 	/* Create root inode */
 	root_inode = ouichefs_iget(sb, 0);
@@ -330,15 +352,23 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto iput;
 	}
 
+	ouichefs_free_worker_init(sb);
+	eviction_tracker_index_init(sb);
+	eviction_tracker_worker_init(sb);
+	ouichefs_sysfs_register(sb);
+
 	return 0;
 
 iput:
 	iput(root_inode);
 free_bfree:
-	kfree(sbi->bfree_bitmap);
+	ouichefs_bitmap_destroy(&sbi->bfree);
 free_ifree:
-	kfree(sbi->ifree_bitmap);
-free_sbi:
+	ouichefs_bitmap_destroy(&sbi->ifree);
+free_counters:
+	percpu_counter_destroy(&sbi->free_blocks);
+	percpu_counter_destroy(&sbi->free_inodes);
+	sb->s_fs_info = NULL;
 	kfree(sbi);
 release:
 	brelse(bh);
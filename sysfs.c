@@ -0,0 +1,236 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/sysfs.h>
+#include <linux/kobject.h>
+
+#include "ouichefs.h"
+#include "sysfs.h"
+
+/*
+ * Statistics of a mounted partition, in /sys/kernel/ouichefs/<device>/
+ */
+
+static ssize_t bitmap_blocks_flushed_show(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  char *buf)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(kobj, struct ouichefs_sb_info, kobj);
+
+	return sysfs_emit(buf, "%ld\n", atomic_long_read(&sbi->bitmap_flushed));
+}
+
+static ssize_t bitmap_blocks_skipped_show(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  char *buf)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(kobj, struct ouichefs_sb_info, kobj);
+
+	return sysfs_emit(buf, "%ld\n", atomic_long_read(&sbi->bitmap_skipped));
+}
+
+static struct kobj_attribute bitmap_blocks_flushed_attr =
+	__ATTR_RO(bitmap_blocks_flushed);
+static struct kobj_attribute bitmap_blocks_skipped_attr =
+	__ATTR_RO(bitmap_blocks_skipped);
+
+/* Eviction counters, one file per counter of struct eviction_tracker_stats */
+#define OUICHEFS_EVICTION_ATTR(_name, _field)                                 \
+	static ssize_t _name##_show(struct kobject *kobj,                     \
+				    struct kobj_attribute *attr, char *buf)   \
+	{                                                                     \
+		struct ouichefs_sb_info *sbi =                                \
+			container_of(kobj, struct ouichefs_sb_info, kobj);    \
+									      \
+		return sysfs_emit(                                            \
+			buf, "%ld\n",                                         \
+			atomic_long_read(&sbi->eviction_stats._field));       \
+	}                                                                     \
+	static struct kobj_attribute _name##_attr = __ATTR_RO(_name)
+
+OUICHEFS_EVICTION_ATTR(evictions_space, evictions[EVICTION_TRIGGER_SPACE]);
+OUICHEFS_EVICTION_ATTR(evictions_background,
+		       evictions[EVICTION_TRIGGER_BACKGROUND]);
+OUICHEFS_EVICTION_ATTR(evictions_dir_full,
+		       evictions[EVICTION_TRIGGER_DIR_FULL]);
+OUICHEFS_EVICTION_ATTR(evictions_manual, evictions[EVICTION_TRIGGER_MANUAL]);
+OUICHEFS_EVICTION_ATTR(evicted_files, files);
+OUICHEFS_EVICTION_ATTR(evicted_blocks, blocks);
+OUICHEFS_EVICTION_ATTR(eviction_scanned, scanned);
+
+/*
+ * Print a histogram of struct eviction_tracker_stats, one "bound count" line
+ * per non-empty bucket: count values were below bound (the last bucket has no
+ * bound and is printed as "inf").
+ */
+static ssize_t ouichefs_hist_show(atomic_long_t *hist, char *buf)
+{
+	unsigned int b;
+	long count;
+	int len = 0;
+
+	for (b = 0; b < EVICTION_STATS_BUCKETS; b++) {
+		count = atomic_long_read(&hist[b]);
+		if (!count)
+			continue;
+		if (b == EVICTION_STATS_BUCKETS - 1)
+			len += sysfs_emit_at(buf, len, "inf %ld\n", count);
+		else
+			len += sysfs_emit_at(buf, len, "%lu %ld\n", 1UL << b,
+					     count);
+	}
+
+	return len;
+}
+
+static ssize_t eviction_scanned_histogram_show(struct kobject *kobj,
+					       struct kobj_attribute *attr,
+					       char *buf)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(kobj, struct ouichefs_sb_info, kobj);
+
+	return ouichefs_hist_show(sbi->eviction_stats.scanned_hist, buf);
+}
+
+static ssize_t eviction_latency_histogram_show(struct kobject *kobj,
+					       struct kobj_attribute *attr,
+					       char *buf)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(kobj, struct ouichefs_sb_info, kobj);
+
+	return ouichefs_hist_show(sbi->eviction_stats.latency_hist, buf);
+}
+
+/*
+ * p50, p90 and p99 of the time to find eviction candidates, in us. They are
+ * the upper bounds of the histogram buckets holding them, so they overestimate
+ * by up to a factor 2 ("inf" for the last bucket, which has no bound).
+ */
+static ssize_t eviction_latency_us_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
+{
+	static const unsigned int percentiles[] = { 50, 90, 99 };
+	struct ouichefs_sb_info *sbi =
+		container_of(kobj, struct ouichefs_sb_info, kobj);
+	atomic_long_t *hist = sbi->eviction_stats.latency_hist;
+	unsigned long counts[EVICTION_STATS_BUCKETS], total = 0, sum;
+	unsigned int b, p;
+	int len = 0;
+
+	for (b = 0; b < EVICTION_STATS_BUCKETS; b++) {
+		counts[b] = atomic_long_read(&hist[b]);
+		total += counts[b];
+	}
+
+	for (p = 0; p < ARRAY_SIZE(percentiles); p++) {
+		sum = 0;
+		for (b = 0; b < EVICTION_STATS_BUCKETS - 1; b++) {
+			sum += counts[b];
+			if (total && sum * 100 >= total * percentiles[p])
+				break;
+		}
+		if (!total)
+			len += sysfs_emit_at(buf, len, "p%u 0\n",
+					     percentiles[p]);
+		else if (b == EVICTION_STATS_BUCKETS - 1)
+			len += sysfs_emit_at(buf, len, "p%u inf\n",
+					     percentiles[p]);
+		else
+			len += sysfs_emit_at(buf, len, "p%u %lu\n",
+					     percentiles[p], 1UL << b);
+	}
+
+	return len;
+}
+
+static struct kobj_attribute eviction_scanned_histogram_attr =
+	__ATTR_RO(eviction_scanned_histogram);
+static struct kobj_attribute eviction_latency_histogram_attr =
+	__ATTR_RO(eviction_latency_histogram);
+static struct kobj_attribute eviction_latency_us_attr =
+	__ATTR_RO(eviction_latency_us);
+
+static struct attribute *ouichefs_sb_attrs[] = {
+	&bitmap_blocks_flushed_attr.attr,
+	&bitmap_blocks_skipped_attr.attr,
+	&evictions_space_attr.attr,
+	&evictions_background_attr.attr,
+	&evictions_dir_full_attr.attr,
+	&evictions_manual_attr.attr,
+	&evicted_files_attr.attr,
+	&evicted_blocks_attr.attr,
+	&eviction_scanned_attr.attr,
+	&eviction_scanned_histogram_attr.attr,
+	&eviction_latency_histogram_attr.attr,
+	&eviction_latency_us_attr.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(ouichefs_sb);
+
+/* The kobject is embedded in the sb_info, let ouichefs_put_super() free it */
+static void ouichefs_sb_release(struct kobject *kobj)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(kobj, struct ouichefs_sb_info, kobj);
+
+	complete(&sbi->kobj_unregister);
+}
+
+static const struct kobj_type ouichefs_sb_ktype = {
+	.sysfs_ops = &kobj_sysfs_ops,
+	.default_groups = ouichefs_sb_groups,
+	.release = ouichefs_sb_release,
+};
+
+/*
+ * Create the sysfs directory of a mounted partition. The partition works
+ * without it, so failures are only logged.
+ */
+void ouichefs_sysfs_register(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int ret;
+
+	if (!ouichefs_kobject)
+		return;
+
+	init_completion(&sbi->kobj_unregister);
+	ret = kobject_init_and_add(&sbi->kobj, &ouichefs_sb_ktype,
+				   ouichefs_kobject, "%s", sb->s_id);
+	if (ret) {
+		pr_err("failed to create /sys/kernel/ouichefs/%s\n", sb->s_id);
+		kobject_put(&sbi->kobj);
+		wait_for_completion(&sbi->kobj_unregister);
+		return;
+	}
+	sbi->kobj_registered = true;
+}
+
+/*
+ * Remove the sysfs directory of a partition and wait until nobody uses it
+ * anymore, so that the sb_info can be freed.
+ */
+void ouichefs_sysfs_unregister(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!sbi->kobj_registered)
+		return;
+
+	kobject_del(&sbi->kobj);
+	kobject_put(&sbi->kobj);
+	wait_for_completion(&sbi->kobj_unregister);
+	sbi->kobj_registered = false;
+}
@@ -0,0 +1,10 @@
+#ifndef _SYSFS_H
+#define _SYSFS_H
+
+/* /sys/kernel/ouichefs, parent of the directories of mounted partitions */
+extern struct kobject *ouichefs_kobject;
+
+void ouichefs_sysfs_register(struct super_block *sb);
+void ouichefs_sysfs_unregister(struct super_block *sb);
+
+#endif
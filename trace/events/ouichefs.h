@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ouichefs
+
+#if !defined(_TRACE_OUICHEFS_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_OUICHEFS_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+/*
+ * Tracepoints of the hot paths, in /sys/kernel/tracing/events/ouichefs/. The
+ * device is printed as major,minor like the other filesystems do.
+ */
+
+/*
+ * Mapping of a run of file blocks: logical block/max blocks asked for, then
+ * physical block/length (0 for a hole) and the error code
+ */
+TRACE_EVENT(ouichefs_map_blocks,
+	TP_PROTO(struct inode *inode, sector_t iblock, uint32_t max_blocks,
+		 bool create, uint32_t bno, uint32_t len, bool new, int ret),
+
+	TP_ARGS(inode, iblock, max_blocks, create, bno, len, new, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(sector_t, iblock)
+		__field(uint32_t, max_blocks)
+		__field(bool, create)
+		__field(uint32_t, bno)
+		__field(uint32_t, len)
+		__field(bool, new)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->iblock = iblock;
+		__entry->max_blocks = max_blocks;
+		__entry->create = create;
+		__entry->bno = bno;
+		__entry->len = len;
+		__entry->new = new;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d ino %lu lblk %llu/%u create %d pblk %u/%u new %d ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  (unsigned long long)__entry->iblock, __entry->max_blocks,
+		  __entry->create, __entry->bno, __entry->len, __entry->new,
+		  __entry->ret)
+);
+
+/* Block allocation, bno is 0 if no block was free */
+TRACE_EVENT(ouichefs_get_free_blocks,
+	TP_PROTO(struct super_block *sb, uint32_t goal, uint32_t max,
+		 uint32_t bno, uint32_t len),
+
+	TP_ARGS(sb, goal, max, bno, len),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint32_t, goal)
+		__field(uint32_t, max)
+		__field(uint32_t, bno)
+		__field(uint32_t, len)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->goal = goal;
+		__entry->max = max;
+		__entry->bno = bno;
+		__entry->len = bno ? len : 0;
+	),
+
+	TP_printk("dev %d,%d goal %u max %u bno %u len %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->goal,
+		  __entry->max, __entry->bno, __entry->len)
+);
+
+DECLARE_EVENT_CLASS(ouichefs_bit_class,
+	TP_PROTO(struct super_block *sb, uint32_t nr),
+
+	TP_ARGS(sb, nr),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint32_t, nr)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->nr = nr;
+	),
+
+	TP_printk("dev %d,%d nr %u", MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->nr)
+);
+
+DEFINE_EVENT(ouichefs_bit_class, ouichefs_get_free_inode,
+	TP_PROTO(struct super_block *sb, uint32_t nr),
+	TP_ARGS(sb, nr)
+);
+
+DEFINE_EVENT(ouichefs_bit_class, ouichefs_put_inode,
+	TP_PROTO(struct super_block *sb, uint32_t nr),
+	TP_ARGS(sb, nr)
+);
+
+DEFINE_EVENT(ouichefs_bit_class, ouichefs_put_block,
+	TP_PROTO(struct super_block *sb, uint32_t nr),
+	TP_ARGS(sb, nr)
+);
+
+/* ouichefs_iget(), hit is true if the inode was in the inode cache */
+TRACE_EVENT(ouichefs_iget,
+	TP_PROTO(struct super_block *sb, unsigned long ino, bool hit),
+
+	TP_ARGS(sb, ino, hit),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(bool, hit)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->hit = hit;
+	),
+
+	TP_printk("dev %d,%d ino %lu %s", MAJOR(__entry->dev),
+		  MINOR(__entry->dev), __entry->ino,
+		  __entry->hit ? "hit" : "miss")
+);
+
+/* Search for eviction candidates below dir */
+TRACE_EVENT(ouichefs_eviction_scan_start,
+	TP_PROTO(struct inode *dir, bool recurse, unsigned long nr_blocks,
+		 unsigned int max_victims),
+
+	TP_ARGS(dir, recurse, nr_blocks, max_victims),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(bool, recurse)
+		__field(unsigned long, nr_blocks)
+		__field(unsigned int, max_victims)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->recurse = recurse;
+		__entry->nr_blocks = nr_blocks;
+		__entry->max_victims = max_victims;
+	),
+
+	TP_printk("dev %d,%d dir %lu recurse %d nr_blocks %lu max_victims %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->recurse, __entry->nr_blocks, __entry->max_victims)
+);
+
+TRACE_EVENT(ouichefs_eviction_scan_end,
+	TP_PROTO(struct inode *dir, unsigned int nr_victims,
+		 unsigned long victims_blocks, unsigned long scanned),
+
+	TP_ARGS(dir, nr_victims, victims_blocks, scanned),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(unsigned int, nr_victims)
+		__field(unsigned long, victims_blocks)
+		__field(unsigned long, scanned)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->nr_victims = nr_victims;
+		__entry->victims_blocks = victims_blocks;
+		__entry->scanned = scanned;
+	),
+
+	TP_printk("dev %d,%d dir %lu victims %u blocks %lu scanned %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->nr_victims, __entry->victims_blocks,
+		  __entry->scanned)
+);
+
+/* Write back of a free bitmap by sync_fs or fsync */
+TRACE_EVENT(ouichefs_bitmap_sync,
+	TP_PROTO(struct super_block *sb, bool inodes, uint32_t flushed,
+		 uint32_t skipped, int wait, int ret),
+
+	TP_ARGS(sb, inodes, flushed, skipped, wait, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(bool, inodes)
+		__field(uint32_t, flushed)
+		__field(uint32_t, skipped)
+		__field(int, wait)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->inodes = inodes;
+		__entry->flushed = flushed;
+		__entry->skipped = skipped;
+		__entry->wait = wait;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d %s flushed %u skipped %u wait %d ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->inodes ? "ifree" : "bfree", __entry->flushed,
+		  __entry->skipped, __entry->wait, __entry->ret)
+);
+
+#endif /* _TRACE_OUICHEFS_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>